@@ -12,6 +12,7 @@
 #include "wifi/wifi.h"
 #include "wifi/wifi_sta.h"
 #include "storage/spiffs.h"
+#include "storage/config_store.h"
 
 #include "sling/sling.h"
 
@@ -36,6 +37,7 @@ void app_main(void) {
     ret = nvs_flash_init();
   }
   ESP_ERROR_CHECK(ret);
+  ESP_ERROR_CHECK(config_store_init());
 
   ESP_ERROR_CHECK(spiffs_init());
 
@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "run_arena.h"
+
+struct run_arena {
+    uint32_t refs;
+    size_t size;
+    size_t used;
+    uint8_t data[] __attribute__((aligned(4)));
+};
+
+static inline size_t align4(size_t size) {
+    return (size + 3) & ~(size_t) 3;
+}
+
+struct run_arena *run_arena_create(size_t size) {
+    if (size > SIZE_MAX - sizeof(struct run_arena) - 3) {
+        return NULL;
+    }
+    size = align4(size);
+
+    struct run_arena *arena = malloc(sizeof(*arena) + size);
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->refs = 1;
+    arena->size = size;
+    arena->used = 0;
+    return arena;
+}
+
+void *run_arena_alloc(struct run_arena *arena, size_t size) {
+    // checked before rounding up, which could wrap; what's left is always a multiple of 4
+    if (size > arena->size - arena->used) {
+        return NULL;
+    }
+    size = align4(size);
+
+    void *ret = arena->data + arena->used;
+    arena->used += size;
+    return ret;
+}
+
+size_t run_arena_remaining(const struct run_arena *arena) {
+    return arena->size - arena->used;
+}
+
+void run_arena_retain(struct run_arena *arena) {
+    __atomic_add_fetch(&arena->refs, 1, __ATOMIC_RELAXED);
+}
+
+void run_arena_release(struct run_arena *arena) {
+    if (arena != NULL && __atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(arena);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef RUN_ARENA_H
+#define RUN_ARENA_H
+
+#include <stddef.h>
+
+/**
+ * bump allocator holding everything that belongs to one run
+ *
+ * the whole arena is one heap block, so releasing a run (on completion or stop) is a single
+ * free no matter how much was allocated from it. it's reference counted so e.g. the program
+ * can still be read after the VM is done with it; it starts with one reference.
+ */
+struct run_arena;
+
+// returns NULL if there isn't enough heap
+struct run_arena *run_arena_create(size_t size);
+
+// returns NULL if the arena is out of space; the memory is 4-byte aligned and not zeroed
+void *run_arena_alloc(struct run_arena *arena, size_t size);
+
+size_t run_arena_remaining(const struct run_arena *arena);
+
+void run_arena_retain(struct run_arena *arena);
+
+// frees the arena once the last reference is gone. NULL is fine
+void run_arena_release(struct run_arena *arena);
+
+#endif
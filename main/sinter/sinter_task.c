@@ -1,20 +1,100 @@
 #include <string.h>
+#include <setjmp.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/message_buffer.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 
 #include "sinter.h"
 #include "sinter_task.h"
+#include "run_arena.h"
 #include "../sling/sling_message.h"
 #include "../sling/sling_sinter.h"
+#include "../sling/sling_ring.h"
 
 static const char *TAG = "sinter_task";
 
-MessageBufferHandle_t mbuf;
+struct sling_ring *display_ring;
 
+#define SINTER_STACK_SIZE 0x8000
+
+// TLS slot whose deletion callback tells us the worker's TCB and stack are free to reuse
+#define SINTER_REAP_TLS_INDEX 1
+
+// the worker lives for as long as the device does, except when a run has to be killed
+static StackType_t sinter_stack[SINTER_STACK_SIZE];
+static StaticTask_t sinter_tcb;
 static xTaskHandle sinter_task_handle;
+static SemaphoreHandle_t sinter_reaped;
+
+// kills a run that overran its time budget; the budget timer can't, since it runs on the shared
+// esp_timer task and killing has to wait for the worker to be reaped
+#define REAPER_STACK_SIZE 0x1000
+static StackType_t reaper_stack[REAPER_STACK_SIZE];
+static StaticTask_t reaper_tcb;
+static xTaskHandle reaper_task_handle;
+// the run the reaper was woken up for
+static volatile uint32_t reap_generation;
+
+struct run_request {
+    struct run_arena *arena;
+    struct sinter_run_params *params;
+    int64_t requested_at;
+};
+
+static QueueHandle_t run_queue;
+
+// arena of the run that's queued or running, set by run_sinter() before it's queued so there's
+// no gap where a run is in flight but looks idle; only released by whoever clears it
+static struct run_arena *current_arena;
+static portMUX_TYPE current_arena_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// long strings are sent in display records of at most this many bytes
+#define VALUE_CHUNK_SIZE 0x400
+
+// what happens to plain output while the display ring is full; a sling_display_overflow
+static volatile uint32_t overflow_policy = sling_display_overflow_block;
+static struct sinter_display_stats display_stats;
+// output dropped by the truncate policy since the last marker
+static uint32_t truncated_pending;
+// the last record committed to the display ring was part of a value continued in the next one
+static bool prev_continued;
+
+// cancellation is cooperative first: the flags are checked at the VM's safe points (every
+// callback into us), which unwind out of sinter_run(). only a program that doesn't reach a safe
+// point within the grace period gets its task deleted.
+#define STOP_GRACE_MS 50
+#define SAFE_POINT_WAIT_MS 10
+
+static volatile bool stop_requested;
+static volatile bool time_limit_hit;
+static volatile bool in_vm;
+static jmp_buf cancel_jmp;
+
+// serializes killing and restarting the worker between stop_sinter() and the reaper
+static SemaphoreHandle_t worker_lock;
+static SemaphoreHandle_t run_done;
+
+static esp_timer_handle_t budget_timer;
+// bumped for every run, so a late budget timer can't kill the next program
+static volatile uint32_t run_generation;
+static uint32_t budget_generation;
+static bool budget_grace;
+// the budget only counts time spent running; it's paused while the program waits for room in the
+// display ring
+static portMUX_TYPE budget_lock = portMUX_INITIALIZER_UNLOCKED;
+// set while the timer is counting down to the time limit, as opposed to paused or in the grace period
+static bool budget_running;
+static int64_t budget_deadline;
+static int64_t budget_left;
+
+// time from run_sinter() to the VM starting, in microseconds
+static int64_t start_latency_min = INT64_MAX;
+static int64_t start_latency_max = 0;
 
 static const char *fault_names[] = {"no fault",
                                     "out of memory",
@@ -28,7 +108,14 @@ static const char *fault_names[] = {"no fault",
                                     "internal error",
                                     "incorrect function arity",
                                     "program called error()",
-                                    "uninitialised heap"};
+                                    "uninitialised heap",
+                                    // raised by sinter_task rather than the VM
+                                    "stopped",
+                                    "time limit exceeded"};
+
+#define FAULT_STOPPED 13
+#define FAULT_TIME_LIMIT 14
+_Static_assert(sizeof(fault_names) / sizeof(fault_names[0]) == FAULT_TIME_LIMIT + 1, "Wrong fault_names size");
 
 /*
  * how should this be done?
@@ -38,32 +125,197 @@ static const char *fault_names[] = {"no fault",
  * hmm...
  */
 
-static void send_val(sinter_value_t *val, bool is_error, bool is_result) {
-    if (mbuf == NULL) {
-        ESP_LOGE(TAG, "Message buffer not available yet in send_val!");
+// safe point: unwinds out of sinter_run() if the run has been cancelled
+static void check_cancel() {
+    if (!in_vm) {
         return;
     }
 
-    struct sling_message_display *payload = sling_sinter_value_to_message(val, NULL);
+    if (stop_requested) {
+        longjmp(cancel_jmp, FAULT_STOPPED);
+    } else if (time_limit_hit) {
+        longjmp(cancel_jmp, FAULT_TIME_LIMIT);
+    }
+}
 
-    if (is_result) {
-        payload->display_type = (is_error ? sling_message_display_type_error : sling_message_display_type_result)
-                                | sling_message_display_type_self_flushing;
-    } else {
-        payload->display_type = (is_error ? sling_message_display_type_error : sling_message_display_type_output);
+/**
+ * stops the time budget while the program waits on something other than itself
+ *
+ * returns false if it wasn't running, e.g. when nested; only resume if this returned true
+ */
+static bool pause_budget() {
+    portENTER_CRITICAL(&budget_lock);
+    bool running = budget_running;
+    budget_running = false;
+    portEXIT_CRITICAL(&budget_lock);
+
+    if (running) {
+        esp_timer_stop(budget_timer);
+        int64_t left = budget_deadline - esp_timer_get_time();
+        // if it was just about to go off, it still goes off right after resuming
+        budget_left = left > 0 ? left : 1;
+    }
+    return running;
+}
+
+static void resume_budget() {
+    budget_deadline = esp_timer_get_time() + budget_left;
+    portENTER_CRITICAL(&budget_lock);
+    budget_running = true;
+    portEXIT_CRITICAL(&budget_lock);
+    esp_timer_start_once(budget_timer, budget_left);
+}
+
+static void stop_budget() {
+    portENTER_CRITICAL(&budget_lock);
+    budget_running = false;
+    portEXIT_CRITICAL(&budget_lock);
+    esp_timer_stop(budget_timer);
+}
+
+// plain output may be dropped or truncated under the overflow policy; results never are
+static bool is_droppable(uint16_t display_type) {
+    display_type &= ~(sling_message_display_type_error | sling_message_display_type_continued);
+    return display_type == sling_message_display_type_output;
+}
+
+/**
+ * commits a display record; display_type is the field after the counter
+ *
+ * only standalone plain output may be dropped from the ring later. results, flushes and every
+ * record of a value split over several are kept, so the backend never gets half a value.
+ */
+static void commit_display(size_t size, uint16_t display_type) {
+    bool continued = (display_type & sling_message_display_type_continued) != 0;
+    sling_ring_commit(display_ring, size, is_droppable(display_type) && !continued && !prev_continued);
+    prev_continued = continued;
+}
+
+// tells the backend how much output the truncate policy dropped, once there's room again
+static void send_truncated_marker() {
+    char marker[48];
+    size_t len = snprintf(marker, sizeof(marker), "[%u display messages dropped]", truncated_pending);
+    size_t payload_len = sizeof(struct sling_message_display) + len + 1;
+
+    struct sling_message_display *payload = sling_ring_reserve(display_ring, payload_len, 0);
+    if (payload == NULL) {
+        return;
+    }
+    payload->display_type = sling_message_display_type_error;
+    payload->data_type = sinter_type_string;
+    payload->string_length = len;
+    memcpy(payload->string, marker, len + 1);
+    commit_display(payload_len, payload->display_type);
+    truncated_pending = 0;
+}
+
+// like sling_ring_reserve, but applies the overflow policy while the ring is full, and stays cancellable
+static void *reserve_display(size_t size, bool droppable) {
+    if (size > sling_ring_max_size(display_ring)) {
+        ESP_LOGE(TAG, "Display message of %d bytes can never fit in the display ring, dropping", size);
+        return NULL;
     }
 
-    size_t payload_len = sizeof(*payload);
-    size_t str_len = (val->type == sinter_type_string ? strlen(val->string_value) + 1 : 0);
-    size_t buf_len = payload_len + str_len;
-    char *buf = malloc(buf_len);
-    memcpy(buf, payload, payload_len);
+    if (truncated_pending > 0) {
+        send_truncated_marker();
+    }
+
+    void *slot = sling_ring_reserve(display_ring, size, 0);
+    if (slot != NULL) {
+        return slot;
+    }
+
+    uint32_t policy = droppable ? overflow_policy : sling_display_overflow_block;
+    if (policy == sling_display_overflow_truncate) {
+        display_stats.truncated++;
+        truncated_pending++;
+        return NULL;
+    }
+    if (policy == sling_display_overflow_block) {
+        display_stats.blocked++;
+    }
+
+    bool paused = pause_budget();
+    while (1) {
+        if (policy == sling_display_overflow_drop_oldest && sling_ring_drop_oldest(display_ring)) {
+            display_stats.dropped++;
+            slot = sling_ring_reserve(display_ring, size, 0);
+        } else {
+            slot = sling_ring_reserve(display_ring, size, pdMS_TO_TICKS(SAFE_POINT_WAIT_MS));
+        }
+        if (slot != NULL) {
+            break;
+        }
+
+        check_cancel();
+        if (stop_requested) { // outside the VM, e.g. sending the result; just drop it
+            break;
+        }
+    }
+    if (paused) {
+        resume_budget();
+    }
+    return slot;
+}
+
+// strings too long for one record go out in order, in pieces the backend joins back up
+static void send_string_fragments(const char *s, size_t len, uint16_t display_type) {
+    bool droppable = is_droppable(display_type);
+    while (len > 0) {
+        size_t n = len > VALUE_CHUNK_SIZE ? VALUE_CHUNK_SIZE : len;
+        size_t payload_len = sizeof(struct sling_message_display) + n + 1;
+
+        struct sling_message_display *payload = reserve_display(payload_len, droppable);
+        if (payload == NULL) {
+            return;
+        }
+        payload->display_type = display_type | (n < len ? sling_message_display_type_continued : 0);
+        payload->data_type = sinter_type_string;
+        payload->string_length = n;
+        memcpy(payload->string, s, n);
+        payload->string[n] = '\0';
+        commit_display(payload_len, payload->display_type);
+
+        s += n;
+        len -= n;
+        droppable = false;
+    }
+}
+
+static void send_display(sinter_value_t *val, uint16_t display_type) {
+    if (display_ring == NULL) {
+        ESP_LOGE(TAG, "Display ring not available yet in send_val!");
+        return;
+    }
+
+    check_cancel();
+
     if (val->type == sinter_type_string) {
-        memcpy(buf + payload_len, val->string_value, str_len - 1);
+        size_t len = strlen(val->string_value);
+        if (len > VALUE_CHUNK_SIZE) {
+            send_string_fragments(val->string_value, len, display_type);
+            return;
+        }
+    }
+
+    size_t payload_len = sling_sinter_value_message_size(val);
+    struct sling_message_display *payload = reserve_display(payload_len, is_droppable(display_type));
+    if (payload == NULL) {
+        return;
     }
+    payload->display_type = display_type;
 
-    xMessageBufferSend(mbuf, buf, buf_len, portMAX_DELAY);
-    free(buf);
+    sling_sinter_value_to_message(val, payload);
+    commit_display(payload_len, payload->display_type);
+}
+
+static void send_val(sinter_value_t *val, bool is_error, bool is_result) {
+    if (is_result) {
+        send_display(val, (is_error ? sling_message_display_type_error : sling_message_display_type_result)
+                          | sling_message_display_type_self_flushing);
+    } else {
+        send_display(val, is_error ? sling_message_display_type_error : sling_message_display_type_output);
+    }
 }
 
 static void print_string(const char *s, bool is_error) {
@@ -82,77 +334,303 @@ static void print_float(float v, bool is_error) {
 }
 
 static void print_flush(bool is_error) {
-    struct sling_message_display_flush *to_send = malloc(sizeof(struct sling_message_display_flush));
+    if (display_ring == NULL) {
+        ESP_LOGE(TAG, "Display ring not available yet in print_flush!");
+        return;
+    }
+
+    check_cancel();
+
+    struct sling_message_display_flush *to_send = reserve_display(sizeof(*to_send), false);
+    if (to_send == NULL) {
+        return;
+    }
     to_send->message_type = sling_message_display_type_flush | (is_error ? sling_message_display_type_error : 0);
+    commit_display(sizeof(*to_send), to_send->message_type);
+}
 
-    size_t buf_len = sizeof(*to_send);
-    char *buf = malloc(buf_len);
-    memcpy(buf, to_send, buf_len);
+static void release_current_run() {
+    portENTER_CRITICAL(&current_arena_lock);
+    struct run_arena *arena = current_arena;
+    current_arena = NULL;
+    portEXIT_CRITICAL(&current_arena_lock);
 
-    xMessageBufferSend(mbuf, buf, buf_len, portMAX_DELAY);
-    free(to_send);
-    free(buf);
+    if (arena != NULL) {
+        run_arena_release(arena);
+        ESP_LOGI(TAG, "Released run, free heap size: %d", xPortGetFreeHeapSize());
+    }
+}
+
+static void sinter_task_deleted(int index, void *ptr) {
+    xSemaphoreGive(sinter_reaped);
+}
+
+static int start_worker(int killed_fault);
+
+/**
+ * last resort for a program that never reaches a safe point. worker_lock must be held.
+ *
+ * unless killed_fault is sinter_fault_none, the new worker sends it as the run's result
+ */
+static int kill_worker(int killed_fault) {
+    if (current_arena == NULL) {
+        return 0;
+    }
+
+    ESP_LOGW(TAG, "Program didn't reach a safe point in time, killing sinter_task");
+    vTaskDelete(sinter_task_handle);
+    // the worker's stack and TCB are static, so wait until FreeRTOS is done with them
+    if (xSemaphoreTake(sinter_reaped, pdMS_TO_TICKS(1000)) != pdTRUE) {
+        ESP_LOGE(TAG, "sinter_task wasn't cleaned up in time, restarting");
+        esp_restart();
+    }
+
+    in_vm = false;
+    run_generation++;
+    stop_budget();
+    release_current_run();
+    return start_worker(killed_fault);
+}
+
+static void budget_timer_cb(void *arg) {
+    if (budget_generation != run_generation) {
+        return;
+    }
+
+    if (!budget_grace) {
+        portENTER_CRITICAL(&budget_lock);
+        bool running = budget_running;
+        budget_running = false;
+        portEXIT_CRITICAL(&budget_lock);
+        if (!running) { // paused as it went off; it'll go off again once resumed
+            return;
+        }
+
+        ESP_LOGW(TAG, "Program ran out of time, cancelling");
+        time_limit_hit = true;
+        budget_grace = true;
+        esp_timer_start_once(budget_timer, STOP_GRACE_MS * 1000);
+        return;
+    }
+
+    // nothing here may block, or it'd hold up every other esp_timer callback
+    reap_generation = budget_generation;
+    xTaskNotifyGive(reaper_task_handle);
+}
+
+static void reaper_task(void *pvParams) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        xSemaphoreTake(worker_lock, portMAX_DELAY);
+        // the program may have reached a safe point, or been stopped, since
+        if (reap_generation == run_generation && current_arena != NULL) {
+            kill_worker(FAULT_TIME_LIMIT);
+        }
+        xSemaphoreGive(worker_lock);
+    }
+}
+
+static void arm_budget(uint32_t time_budget_ms) {
+    budget_generation = run_generation;
+    budget_grace = false;
+    budget_deadline = esp_timer_get_time() + (int64_t) time_budget_ms * 1000;
+    portENTER_CRITICAL(&budget_lock);
+    budget_running = time_budget_ms > 0;
+    portEXIT_CRITICAL(&budget_lock);
+    if (time_budget_ms > 0) {
+        esp_timer_start_once(budget_timer, (uint64_t) time_budget_ms * 1000);
+    }
 }
 
 static void sinter_task(void *pvParams) {
-    // TODO is this safe...?
-    struct sinter_run_params *params = (struct sinter_run_params *) pvParams;
+    vTaskSetThreadLocalStoragePointerAndDelCallback(NULL, SINTER_REAP_TLS_INDEX, NULL, sinter_task_deleted);
 
     sinter_printer_float = print_float;
     sinter_printer_string = print_string;
     sinter_printer_integer = print_integer;
     sinter_printer_flush = print_flush;
 
-    // TODO uuuuuuuuuuh it feels pretty dangerous to me, in case pvParams is smaller than sling_sinter_program?
-    sinter_value_t result = {0};
-    sinter_fault_t fault = sinter_run(params->code, params->code_size, &result);
+    // the previous worker was killed before it could send its run's result
+    int killed_fault = (intptr_t) pvParams;
+    if (killed_fault != sinter_fault_none) {
+        sinter_value_t result = {.type = sinter_type_string, .string_value = fault_names[killed_fault]};
+        send_val(&result, true, true);
+    }
 
-    ESP_LOGI(TAG, "Program exited with fault %d and result type %d (%d, %d, %f)\n", fault, result.type, result.integer_value, result.boolean_value, result.float_value);
+    while (1) {
+        struct run_request request;
+        xQueueReceive(run_queue, &request, portMAX_DELAY);
 
-    if (fault != sinter_fault_none) {
-        result.type = sinter_type_string;
-        result.string_value = fault_names[fault];
-    }
+        struct sinter_run_params *params = request.params;
+        sinter_value_t result = {0};
+        sinter_fault_t fault;
 
-    send_val(&result, fault != sinter_fault_none, true);
+        arm_budget(params->time_budget_ms);
 
-    free(params);
-    ESP_LOGI(TAG, "task high water mark: %d", uxTaskGetStackHighWaterMark(NULL));
-    sinter_task_handle = NULL;
-    vTaskDelete(NULL);
-}
+        int64_t latency = esp_timer_get_time() - request.requested_at;
+        if (latency < start_latency_min) start_latency_min = latency;
+        if (latency > start_latency_max) start_latency_max = latency;
+        ESP_LOGI(TAG, "Starting program after %lld us (min %lld, max %lld)", latency, start_latency_min, start_latency_max);
+
+        in_vm = true;
+        if (stop_requested) { // stopped between being queued and getting here
+            fault = FAULT_STOPPED;
+        } else if (setjmp(cancel_jmp) == 0) {
+            fault = sinter_run(params->code, params->code_size, &result);
+        } else {
+            // sinter keeps its state in static buffers and resets them on every sinter_run(),
+            // so unwinding out of it from a callback is safe
+            fault = stop_requested ? FAULT_STOPPED : FAULT_TIME_LIMIT;
+        }
+        in_vm = false;
+        run_generation++;
+        stop_budget();
+
+        ESP_LOGI(TAG, "Program exited with fault %d and result type %d (%d, %d, %f)\n", fault, result.type, result.integer_value, result.boolean_value, result.float_value);
 
-int run_sinter(unsigned char *binary, size_t size) {
-    size_t params_size = sizeof(struct sinter_run_params) + size;
-    struct sinter_run_params *params = malloc(params_size); // freed in sinter_task
-    params->code_size = size;
-    memcpy(params->code, binary, size);
+        if (fault != sinter_fault_none) {
+            result.type = sinter_type_string;
+            result.string_value = fault_names[fault];
+        }
 
-    BaseType_t result = xTaskCreatePinnedToCore(sinter_task,
+        if (fault != FAULT_STOPPED) { // the stop request gets its own status reply
+            send_val(&result, fault != sinter_fault_none, true);
+        }
+
+        release_current_run();
+        xSemaphoreGive(run_done);
+        ESP_LOGI(TAG, "task high water mark: %d", uxTaskGetStackHighWaterMark(NULL));
+    }
+}
+
+static int start_worker(int killed_fault) {
+    sinter_task_handle = xTaskCreateStaticPinnedToCore(sinter_task,
         "sinter_task",
-        0x8000,
-        (void*)params,
+        SINTER_STACK_SIZE,
+        (void *) (intptr_t) killed_fault,
         2,
-        &sinter_task_handle,
+        sinter_stack,
+        &sinter_tcb,
         1);
 
-    if (result != pdPASS) {
-        ESP_LOGE(TAG, "Failed to start sinter_task with result %d. Out of heap space?", result);
-        ESP_LOGE(TAG, "Free heap size: %d, min free heap size since boot: %d", xPortGetFreeHeapSize(), xPortGetMinimumEverFreeHeapSize());
-        sinter_task_handle = NULL;
+    if (sinter_task_handle == NULL) {
+        ESP_LOGE(TAG, "Failed to start sinter_task");
         return 1;
     }
 
     return 0;
 }
 
-int stop_sinter() {
-    if (sinter_task_handle != NULL) { // don't accidentally kill the sling task
-        vTaskDelete(sinter_task_handle);
-        sinter_task_handle = NULL;
-        return 0;
-    } else {
-        ESP_LOGW(TAG, "sinter task handle invalid -- already stopped?");
+int sinter_task_init() {
+    run_queue = xQueueCreate(1, sizeof(struct run_request));
+    sinter_reaped = xSemaphoreCreateBinary();
+    run_done = xSemaphoreCreateBinary();
+    worker_lock = xSemaphoreCreateMutex();
+    if (run_queue == NULL || sinter_reaped == NULL || run_done == NULL || worker_lock == NULL) {
+        ESP_LOGE(TAG, "Error allocating sinter_task queue");
+        return 1;
+    }
+
+    const esp_timer_create_args_t budget_timer_args = {
+        .callback = budget_timer_cb,
+        .name = "sinter_budget",
+    };
+    if (esp_timer_create(&budget_timer_args, &budget_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Error creating budget timer");
+        return 1;
+    }
+
+    // above the worker, so an overrunning program can't starve it
+    reaper_task_handle = xTaskCreateStaticPinnedToCore(reaper_task,
+        "sinter_reaper",
+        REAPER_STACK_SIZE,
+        NULL,
+        3,
+        reaper_stack,
+        &reaper_tcb,
+        1);
+    if (reaper_task_handle == NULL) {
+        ESP_LOGE(TAG, "Failed to start sinter_reaper");
         return 1;
     }
+
+    return start_worker(sinter_fault_none);
+}
+
+int run_sinter(struct run_arena *arena, struct sinter_run_params *params) {
+    // sinter isn't reentrant, so a new run replaces whatever is still running
+    if (current_arena != NULL) {
+        ESP_LOGW(TAG, "Program still running, stopping it first");
+        stop_sinter();
+    }
+
+    struct run_request request = {
+        .arena = arena, // released by sinter_task, or whoever drops the run
+        .params = params,
+        .requested_at = esp_timer_get_time(),
+    };
+
+    // the flags are latched from here on, so a stop that comes before the worker picks this up
+    // still counts
+    portENTER_CRITICAL(&current_arena_lock);
+    stop_requested = false;
+    time_limit_hit = false;
+    current_arena = arena;
+    portEXIT_CRITICAL(&current_arena_lock);
+
+    if (xQueueSend(run_queue, &request, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to queue program, sinter_task busy?");
+        release_current_run();
+        return 1;
+    }
+
+    return 0;
+}
+
+int sinter_set_overflow_policy(uint32_t policy) {
+    if (policy > sling_display_overflow_truncate) {
+        ESP_LOGW(TAG, "Unknown display overflow policy %d", policy);
+        return 1;
+    }
+
+    overflow_policy = policy;
+    ESP_LOGI(TAG, "Display overflow policy set to %d", policy);
+    return 0;
+}
+
+void sinter_get_display_stats(struct sinter_display_stats *stats) {
+    *stats = display_stats;
+}
+
+int stop_sinter() {
+    // drop a run that was queued but hasn't started yet
+    struct run_request request;
+    bool dropped = xQueueReceive(run_queue, &request, 0) == pdTRUE;
+    if (dropped) {
+        // it's the current run, which the worker never got to
+        release_current_run();
+    }
+
+    if (current_arena == NULL) {
+        if (!dropped) {
+            ESP_LOGW(TAG, "sinter task idle -- already stopped?");
+        }
+        return dropped ? 0 : 1;
+    }
+
+    xSemaphoreTake(worker_lock, portMAX_DELAY);
+
+    // ask nicely first; the worker gives run_done once it's back to waiting for a run
+    stop_requested = true;
+    TickType_t start = xTaskGetTickCount();
+    while (current_arena != NULL && xTaskGetTickCount() - start < pdMS_TO_TICKS(STOP_GRACE_MS)) {
+        xSemaphoreTake(run_done, pdMS_TO_TICKS(SAFE_POINT_WAIT_MS));
+    }
+
+    // the stop request gets its own status reply
+    int ret = kill_worker(sinter_fault_none);
+    ESP_LOGI(TAG, "Stopped program in %d ms", (xTaskGetTickCount() - start) * portTICK_PERIOD_MS);
+    xSemaphoreGive(worker_lock);
+    return ret;
 }
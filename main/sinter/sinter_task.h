@@ -1,15 +1,49 @@
+#ifndef SINTER_TASK_H
+#define SINTER_TASK_H
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/message_buffer.h"
-
-extern MessageBufferHandle_t mbuf;
 
-int run_sinter(unsigned char *binary, size_t size);
+#include "../sling/sling_ring.h"
+#include "run_arena.h"
 
-int stop_sinter();
+// display records from the VM, consumed by the MQTT publisher
+extern struct sling_ring *display_ring;
 
 struct __attribute__((packed)) sinter_run_params {
+    // time the program may spend running, not counting waits for display space; 0 for no limit
+    uint32_t time_budget_ms;
     size_t code_size;
     unsigned char code[];
 };
-_Static_assert(sizeof(struct sinter_run_params) == 4, "Wrong sinter_run_params size");
\ No newline at end of file
+_Static_assert(sizeof(struct sinter_run_params) == 8, "Wrong sinter_run_params size");
+
+// starts the VM worker; call once before run_sinter()
+int sinter_task_init();
+
+/**
+ * queues params for the worker
+ *
+ * params must live in arena. takes ownership of arena, which is released in one go when the
+ * run completes or is stopped, even if starting the run fails.
+ */
+int run_sinter(struct run_arena *arena, struct sinter_run_params *params);
+
+int stop_sinter();
+
+// how often each overflow policy kicked in since boot
+struct sinter_display_stats {
+    // output that had to wait for the publisher
+    uint32_t blocked;
+    // records dropped from the ring to make room
+    uint32_t dropped;
+    // output dropped in favour of a marker
+    uint32_t truncated;
+};
+
+// sets what happens to output while the display ring is full; a sling_display_overflow
+int sinter_set_overflow_policy(uint32_t policy);
+
+void sinter_get_display_stats(struct sinter_display_stats *stats);
+
+#endif
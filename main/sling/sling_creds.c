@@ -0,0 +1,163 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+
+#include "sling_creds.h"
+
+static const char *TAG = "sling_creds";
+
+#define CREDS_PARTITION "creds"
+#define CREDS_MAGIC 0x31524443 // "CDR1"
+
+// enough for a DER-encoded 4096-bit RSA key
+#define CREDS_KEY_DER_MAX 2560
+
+#define FLASH_SECTOR_SIZE 0x1000
+
+// followed by the cert, then the key
+struct __attribute__((packed)) creds_hdr {
+    uint32_t magic;
+    uint32_t crc; // over everything after this field, up to the end of the key
+    uint16_t cert_len;
+    uint16_t key_len;
+};
+
+static const esp_partition_t *partition;
+static const uint8_t *mapped;
+static spi_flash_mmap_handle_t mapped_handle;
+
+int sling_creds_init(void) {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CREDS_PARTITION);
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "Failed to find %s partition", CREDS_PARTITION);
+        return 1;
+    }
+
+    // mapped for good; esp-mqtt keeps pointing at the credentials after we hand them over
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA,
+                                       (const void **) &mapped, &mapped_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map %s partition (%s)", CREDS_PARTITION, esp_err_to_name(err));
+        partition = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint32_t creds_crc(const struct creds_hdr *hdr) {
+    return esp_rom_crc32_le(0, (const uint8_t *) &hdr->cert_len,
+                            sizeof(*hdr) - offsetof(struct creds_hdr, cert_len) + hdr->cert_len + hdr->key_len);
+}
+
+bool sling_creds_get(const uint8_t **cert, size_t *cert_len, const uint8_t **key, size_t *key_len) {
+    if (mapped == NULL) {
+        return false;
+    }
+
+    const struct creds_hdr *hdr = (const struct creds_hdr *) mapped;
+    if (hdr->magic != CREDS_MAGIC || sizeof(*hdr) + hdr->cert_len + hdr->key_len > partition->size
+        || creds_crc(hdr) != hdr->crc) {
+        return false;
+    }
+
+    *cert = mapped + sizeof(*hdr);
+    *cert_len = hdr->cert_len;
+    *key = *cert + hdr->cert_len;
+    *key_len = hdr->key_len;
+    return true;
+}
+
+// lays out the stored image for the given PEM credentials; returns NULL if they don't parse
+static uint8_t *build_image(const char *cert_pem, const char *key_pem, size_t *size) {
+    uint8_t *image = NULL;
+    uint8_t *key_der = malloc(CREDS_KEY_DER_MAX);
+    mbedtls_x509_crt crt;
+    mbedtls_pk_context pk;
+    mbedtls_x509_crt_init(&crt);
+    mbedtls_pk_init(&pk);
+
+    int ret;
+    if (key_der == NULL) {
+        ESP_LOGE(TAG, "Out of memory converting credentials");
+    } else if ((ret = mbedtls_x509_crt_parse(&crt, (const unsigned char *) cert_pem, strlen(cert_pem) + 1)) != 0) {
+        ESP_LOGE(TAG, "Error -0x%x parsing client cert", -ret);
+    } else if ((ret = mbedtls_pk_parse_key(&pk, (const unsigned char *) key_pem, strlen(key_pem) + 1, NULL, 0)) != 0) {
+        ESP_LOGE(TAG, "Error -0x%x parsing client key", -ret);
+    } else if ((ret = mbedtls_pk_write_key_der(&pk, key_der, CREDS_KEY_DER_MAX)) < 0) {
+        ESP_LOGE(TAG, "Error -0x%x converting client key to DER", -ret);
+    } else if (sizeof(struct creds_hdr) + crt.raw.len + ret > partition->size) {
+        ESP_LOGE(TAG, "Credentials don't fit in the %s partition", CREDS_PARTITION);
+    } else {
+        // the key is written at the end of key_der
+        size_t key_len = ret;
+        *size = sizeof(struct creds_hdr) + crt.raw.len + key_len;
+        image = malloc(*size);
+        if (image == NULL) {
+            ESP_LOGE(TAG, "Out of memory converting credentials");
+        } else {
+            struct creds_hdr *hdr = (struct creds_hdr *) image;
+            hdr->magic = CREDS_MAGIC;
+            hdr->cert_len = crt.raw.len;
+            hdr->key_len = key_len;
+            memcpy(image + sizeof(*hdr), crt.raw.p, crt.raw.len);
+            memcpy(image + sizeof(*hdr) + crt.raw.len, key_der + CREDS_KEY_DER_MAX - key_len, key_len);
+            hdr->crc = creds_crc(hdr);
+        }
+    }
+
+    mbedtls_x509_crt_free(&crt);
+    mbedtls_pk_free(&pk);
+    if (key_der != NULL) {
+        // it held a private key
+        memset(key_der, 0, CREDS_KEY_DER_MAX);
+        free(key_der);
+    }
+    return image;
+}
+
+int sling_creds_store(const char *cert_pem, const char *key_pem, void (*release)(void), bool *changed) {
+    *changed = false;
+    if (partition == NULL) {
+        return 1;
+    }
+
+    size_t size;
+    uint8_t *image = build_image(cert_pem, key_pem, &size);
+    if (image == NULL) {
+        return 1;
+    }
+
+    // spare the flash if nothing changed; the header has the CRC, so it's usually enough to tell
+    esp_err_t err = ESP_OK;
+    bool same = memcmp(mapped, image, sizeof(struct creds_hdr)) == 0 && memcmp(mapped, image, size) == 0;
+    if (!same) {
+        // the partition is erased while mapped, so nothing can be reading it
+        if (release != NULL) {
+            release();
+        }
+        ESP_LOGI(TAG, "Storing %d bytes of credentials", size);
+        size_t erase_size = (size + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+        err = esp_partition_erase_range(partition, 0, erase_size);
+        if (err == ESP_OK) {
+            err = esp_partition_write(partition, 0, image, size);
+        }
+    }
+
+    memset(image, 0, size);
+    free(image);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error %s writing %s partition", esp_err_to_name(err), CREDS_PARTITION);
+        return 1;
+    }
+
+    *changed = !same;
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef SLING_CREDS_H
+#define SLING_CREDS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * the MQTT client cert and key, kept as DER in the raw creds partition
+ *
+ * the partition is memory-mapped, so the TLS stack reads them straight out of flash and they
+ * take no heap between handshakes.
+ */
+int sling_creds_init(void);
+
+/**
+ * points cert and key at the stored credentials
+ *
+ * they point into the partition, so storing new ones changes them underneath whoever holds
+ * them. returns false if there are none, or they're corrupt.
+ */
+bool sling_creds_get(const uint8_t **cert, size_t *cert_len, const uint8_t **key, size_t *key_len);
+
+/**
+ * converts PEM credentials to DER and stores them, unless they're already stored
+ *
+ * if they have to be replaced, release is called first, unless it's NULL, so anything still
+ * reading the old ones from sling_creds_get() can stop. changed is set if the stored credentials
+ * were replaced. returns 0 if successful
+ */
+int sling_creds_store(const char *cert_pem, const char *key_pem, void (*release)(void), bool *changed);
+
+#endif
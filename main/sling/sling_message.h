@@ -9,15 +9,112 @@
 #define SLING_INTOPIC_STOP "stop"
 #define SLING_INTOPIC_PING "ping"
 #define SLING_INTOPIC_INPUT "input"
+#define SLING_INTOPIC_FEATURES "features"
+#define SLING_INTOPIC_RUN_HASH "run_hash"
+#define SLING_INTOPIC_RUN_DELTA "run_delta"
+#define SLING_INTOPIC_CONFIG "config"
+#define SLING_INTOPIC_RETRANSMIT "retransmit"
 
 #define SLING_OUTTOPIC_STATUS "status"
 #define SLING_OUTTOPIC_DISPLAY "display"
 #define SLING_OUTTOPIC_HELLO "hello"
+#define SLING_OUTTOPIC_STATS "stats"
+
+// enough for "<client id>/<topic>", with the 16-byte sling_config client_id
+#define SLING_TOPIC_MAX 40
+
+// advertised in hello; the backend opts in to a subset of them on the features topic
+enum sling_feature {
+  sling_feature_display_batch = 1 << 0,
+  // run_hash is accepted; no opt-in needed
+  sling_feature_program_cache = 1 << 1,
+  // run_delta is accepted; no opt-in needed
+  sling_feature_program_delta = 1 << 2,
+  // run may carry a sling_message_run_compressed; no opt-in needed
+  sling_feature_compressed_run = 1 << 3,
+  // plain display output is sent at QoS 0; the backend watches message_counter for gaps and
+  // asks for them on the retransmit topic. results are always sent at QoS 1.
+  sling_feature_display_qos0 = 1 << 4
+};
+
+// asks for display messages covering any counter in [first_counter, last_counter] to be sent again,
+// if they're still in the device's window (the last 8 KB or 32 messages)
+struct __attribute__((packed)) sling_message_retransmit {
+  uint32_t first_counter;
+  uint32_t last_counter;
+};
+_Static_assert(sizeof(struct sling_message_retransmit) == 8, "Wrong sling_message_retransmit size");
+
+struct __attribute__((packed)) sling_message_features {
+  uint32_t features;
+};
+_Static_assert(sizeof(struct sling_message_features) == 4, "Wrong sling_message_features size");
+
+#define SLING_RUN_COMPRESSED_MAGIC 0x315a4c53 // "SLZ1"
+
+// run payload, after the 4-byte prefix, for a zlib-compressed program; raw SVML never starts with the magic
+struct __attribute__((packed)) sling_message_run_compressed {
+  uint32_t magic;
+  // size of the program once inflated
+  uint32_t size;
+  // followed by the zlib stream
+  char data[];
+};
+_Static_assert(sizeof(struct sling_message_run_compressed) == 8, "Wrong sling_message_run_compressed size");
+
+// run_delta payload, after the same 4-byte prefix as run
+struct __attribute__((packed)) sling_message_run_delta {
+  // a program sent to the device earlier, which it should have cached
+  uint8_t base_hash[32];
+  uint8_t target_hash[32];
+  uint32_t target_size;
+  // followed by ops, applied in order to build the target from scratch
+  char ops[];
+};
+_Static_assert(sizeof(struct sling_message_run_delta) == 68, "Wrong sling_message_run_delta size");
+
+enum sling_delta_op {
+  // followed by uint32_t offset, uint32_t length: copy from the base
+  sling_delta_op_copy = 0,
+  // followed by uint32_t length, then that many bytes: copy from the delta
+  sling_delta_op_insert = 1
+};
+
+// sets one runtime option; they all go back to their defaults on reboot
+struct __attribute__((packed)) sling_message_config {
+  uint16_t key;
+  uint32_t value;
+};
+_Static_assert(sizeof(struct sling_message_config) == 6, "Wrong sling_message_config size");
+
+enum sling_config_key {
+  // a sling_display_overflow
+  sling_config_display_overflow = 1,
+  // display output budget, in records and in bytes per second; 0 for no limit.
+  // output over budget is suppressed, and summarized as "[N lines suppressed]"
+  sling_config_display_rate_msgs = 2,
+  sling_config_display_rate_bytes = 3,
+  // how long a program may run before it's stopped with "time limit exceeded", in ms; 0 for no
+  // limit (the default). time spent waiting for output to be published doesn't count.
+  // applies from the next run
+  sling_config_time_budget = 4
+};
+
+// what happens to program output while it's produced faster than it can be published
+enum sling_display_overflow {
+  // the program waits (the default)
+  sling_display_overflow_block = 0,
+  // the oldest unpublished output is discarded
+  sling_display_overflow_drop_oldest = 1,
+  // new output is discarded, and replaced by a count of what was lost once there's room
+  sling_display_overflow_truncate = 2
+};
 
 enum sling_message_status_type {
   sling_message_status_type_idle = 0,
   sling_message_status_type_running = 1,
-  sling_message_status_type_prompt = 2
+  sling_message_status_type_prompt = 2,
+  sling_message_status_type_cache_miss = 3
 };
 
 struct __attribute__((packed)) sling_message_status {
@@ -35,13 +132,39 @@ struct __attribute__((packed)) sling_message_status_prompt {
 };
 _Static_assert(sizeof(struct sling_message_status_prompt) == 10, "Wrong sling_message_status_prompt size");
 
+// sent in reply to a run_hash or run_delta we can't serve; the backend uploads the program on run instead
+struct __attribute__((packed)) sling_message_status_cache_miss {
+  uint32_t message_counter;
+  uint16_t status;
+  uint8_t hash[32];
+};
+_Static_assert(sizeof(struct sling_message_status_cache_miss) == 38, "Wrong sling_message_status_cache_miss size");
+
+struct __attribute__((packed)) sling_message_stats {
+  uint32_t message_counter;
+  uint32_t cache_hits;
+  uint32_t cache_misses;
+  // how often each sling_display_overflow policy kicked in
+  uint32_t display_blocked;
+  uint32_t display_dropped;
+  uint32_t display_truncated;
+  // output over the display budget since boot, and the budget itself
+  uint32_t display_suppressed;
+  uint32_t display_rate_msgs;
+  uint32_t display_rate_bytes;
+};
+_Static_assert(sizeof(struct sling_message_stats) == 36, "Wrong sling_message_stats size");
+
 enum sling_message_display_type {
   sling_message_display_type_output = 0,
   sling_message_display_type_error = 1,
   sling_message_display_type_result = 2,
   sling_message_display_type_prompt_response = 4,
   sling_message_display_type_flush = 100,
-  sling_message_display_type_self_flushing = 0x100
+  sling_message_display_type_batch = 200,
+  sling_message_display_type_self_flushing = 0x100,
+  // more records with the rest of this value follow: the rest of a string longer than 1 KB
+  sling_message_display_type_continued = 0x200
 };
 
 struct __attribute__((packed)) sling_message_display_flush {
@@ -67,6 +190,17 @@ struct __attribute__((packed)) sling_message_display {
 };
 _Static_assert(sizeof(struct sling_message_display) == 12, "Wrong sling_message_display size");
 
+// only sent if the backend enabled sling_feature_display_batch
+struct __attribute__((packed)) sling_message_display_batch {
+  // counter of the first record in the batch
+  uint32_t message_counter;
+  uint16_t display_type;
+  uint16_t record_count;
+  // followed by record_count records, each prefixed with its uint16_t length
+  char records[];
+};
+_Static_assert(sizeof(struct sling_message_display_batch) == 8, "Wrong sling_message_display_batch size");
+
 static inline char *sling_topic(const char *device_id, const char *topic) {
   char *ret = NULL;
   if (asprintf(&ret, "%s/%s", device_id, topic) == -1) {
@@ -4,13 +4,14 @@
 #include <string.h>
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/message_buffer.h"
+#include "freertos/semphr.h"
 
 #include "esp_system.h"
 #include "nvs_flash.h"
 #include "esp_event.h"
 #include "esp_netif.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "mqtt_client.h"
 #include "esp_tls.h"
 #include "esp_ota_ops.h"
@@ -20,13 +21,95 @@
 #include "../sling/sling_message.h"
 #include "../sling/sling_sinter.h"
 #include "../sling/sling.h"
+#include "../sling/sling_ring.h"
+#include "../sling/sling_run.h"
+#include "../sling/sling_rate.h"
+#include "../sling/sling_window.h"
+#include "../sling/sling_creds.h"
+#include "../storage/program_cache.h"
+#include "../storage/spool.h"
 
 static const char *TAG = "mqtt";
 
+// batches stay below the MQTT client's buffer_size, so a batch goes out in one write
+#define DISPLAY_BATCH_SIZE 0xC00
+#define DISPLAY_BATCH_TIMEOUT_MS 20
+
+// display output budget, per second; off until the backend sets one with the
+// sling_config_display_rate_* keys, so plain output isn't suppressed behind its back
+#define DISPLAY_RATE_MSGS 0
+#define DISPLAY_RATE_BYTES 0
+#define SUPPRESSED_NOTICE_MS 100
+
+// display publishes that may wait for their PUBACK before the publisher holds off; a full
+// display ring of 1 KB records, so a slow round trip doesn't throttle output on its own
+#define DISPLAY_RING_SIZE 0x4000
+#define DISPLAY_IN_FLIGHT_MAX (DISPLAY_RING_SIZE / 0x400)
+#define IN_FLIGHT_WAIT_MS 1000
+#define CONTROL_WAIT_MS 10
+
+// kinds of spooled messages; only display output so far
+#define SPOOL_DISPLAY 0
+// how often a publisher blocked on a full spool checks whether we're back
+#define SPOOL_WAIT_MS 100
+
+// QoS 0 display messages kept for retransmits
+#define DISPLAY_WINDOW_SIZE 0x2000
+
+#define SUPPORTED_FEATURES (sling_feature_display_batch | sling_feature_program_cache | sling_feature_program_delta \
+    | sling_feature_compressed_run | sling_feature_display_qos0)
+
 static uint32_t msg_no = 0;
 static uint32_t display_start_counter = 0;
 static bool needs_flush = false;
 
+// features the backend opted in to since we last connected
+static uint32_t enabled_features = 0;
+
+// display output budget; output over it is suppressed, and summarized once there's budget again
+static struct sling_rate display_msg_budget;
+static struct sling_rate display_byte_budget;
+static uint32_t suppressed_lines = 0;
+static uint32_t display_suppressed = 0;
+// whether the publisher is in the middle of a value split over several records
+static bool in_value = false;
+static bool suppressing_value = false;
+
+// see wait_for_display_lane()
+static volatile uint32_t control_pending = 0;
+static volatile uint32_t publishes_in_flight = 0;
+static portMUX_TYPE lane_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t control_done;
+static SemaphoreHandle_t publish_acked;
+
+// time from receiving stop to the broker acking our idle status, in microseconds
+static volatile int stop_reply_msg_id = -1;
+static int64_t stop_received_at;
+static int64_t stop_latency_min = INT64_MAX;
+static int64_t stop_latency_max = 0;
+
+static volatile bool mqtt_connected = false;
+static SemaphoreHandle_t reconnected;
+
+// TCP + TLS handshake + CONNACK, from MQTT_EVENT_BEFORE_CONNECT to MQTT_EVENT_CONNECTED
+static int64_t connect_started_at;
+static uint32_t heap_before_connect;
+static uint32_t connect_count = 0;
+
+// display messages sent at QoS 0, for retransmits; only allocated once the backend opts in
+static struct sling_window *display_window;
+
+// set once the client is started; see sling_mqtt_stop()
+static esp_mqtt_client_handle_t mqtt_client;
+static bool mqtt_stopped = false;
+static portMUX_TYPE client_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static char *batch_buf;
+static size_t batch_len = 0;
+static TickType_t batch_deadline;
+static uint32_t batch_last_counter;
+static bool batch_reliable = false;
+
 struct sling_config *config;
 
 static void uint32_to_char4(char buf[static 4], uint32_t val) {
@@ -43,10 +126,10 @@ static void uint32_to_char4(char buf[static 4], uint32_t val) {
 //     buf[1] = val & 0xFF;
 // }
 
-static void send_raw(esp_mqtt_client_handle_t client, char *msg_type, char *payload, size_t payload_size) {
-    size_t topic_sz = strlen(config->client_id) + strlen(msg_type) + 2; // uhh, null terminator?
-    char *topic = malloc(topic_sz);
-    snprintf(topic, topic_sz, "%s/%s", config->client_id, msg_type);
+// returns the message id (0 at QoS 0), or -1 if it couldn't be sent
+static int send_raw_qos(esp_mqtt_client_handle_t client, char *msg_type, char *payload, size_t payload_size, int qos) {
+    char topic[SLING_TOPIC_MAX];
+    snprintf(topic, sizeof(topic), "%s/%s", config->client_id, msg_type);
 
     ESP_LOGI(TAG, "Sending message to topic %s", topic);
 
@@ -58,48 +141,355 @@ static void send_raw(esp_mqtt_client_handle_t client, char *msg_type, char *payl
     printf("\n");
     #endif
 
-    esp_mqtt_client_publish(client, topic, payload, payload_size, 1, 0);
-    free(topic);
+    int msg_id = esp_mqtt_client_publish(client, topic, payload, payload_size, qos, 0);
+    if (qos > 0 && msg_id > 0) {
+        portENTER_CRITICAL(&lane_lock);
+        publishes_in_flight++;
+        portEXIT_CRITICAL(&lane_lock);
+    }
+    return msg_id;
+}
+
+static int send_raw(esp_mqtt_client_handle_t client, char *msg_type, char *payload, size_t payload_size) {
+    return send_raw_qos(client, msg_type, payload, payload_size, 1);
+}
+
+/**
+ * keeps display output out of the way of control replies: it holds off while a control message
+ * is being handled, and while too many publishes are still waiting for their PUBACK, so a reply
+ * never queues behind more than DISPLAY_IN_FLIGHT_MAX display messages in the outbox and socket.
+ */
+static void wait_for_display_lane() {
+    while (control_pending > 0) {
+        xSemaphoreTake(control_done, pdMS_TO_TICKS(CONTROL_WAIT_MS));
+    }
+
+    // PUBACKs can get lost with the connection, so don't wait for them forever
+    TickType_t start = xTaskGetTickCount();
+    while (publishes_in_flight >= DISPLAY_IN_FLIGHT_MAX) {
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(IN_FLIGHT_WAIT_MS)) {
+            ESP_LOGW(TAG, "No PUBACK for %u publishes in %d ms, sending anyway", publishes_in_flight, IN_FLIGHT_WAIT_MS);
+            break;
+        }
+        xSemaphoreTake(publish_acked, pdMS_TO_TICKS(CONTROL_WAIT_MS));
+    }
+}
+
+static void replay_message(void *ctx, uint8_t kind, char *payload, size_t len) {
+    if (kind != SPOOL_DISPLAY) {
+        ESP_LOGW(TAG, "Dropping spooled message of unknown kind %d", kind);
+        return;
+    }
+    wait_for_display_lane();
+    send_raw(ctx, "display", payload, len);
+}
+
+/**
+ * while MQTT is down, the publisher's messages go to the spool rather than piling up in the
+ * outbox. once it's back, the spool is replayed before anything new, so counters stay in order.
+ *
+ * returns true if the message was spooled.
+ */
+static bool spool_while_offline(esp_mqtt_client_handle_t client, uint8_t kind, char *payload, size_t len) {
+    while (!mqtt_connected) {
+        if (spool_append(kind, payload, len)) {
+            return true;
+        }
+        // spool full (or missing): hold the publisher, and with it the program, until we're back
+        xSemaphoreTake(reconnected, pdMS_TO_TICKS(SPOOL_WAIT_MS));
+    }
+
+    if (!spool_empty()) {
+        spool_replay(replay_message, client);
+    }
+    return false;
+}
+
+/**
+ * sends a display message covering counters [first, last]
+ *
+ * if the backend opted in, plain output goes out at QoS 0 and is kept in display_window in case
+ * the backend notices a gap in the counters; anything carrying a result is always QoS 1.
+ */
+static void send_display(esp_mqtt_client_handle_t client, char *payload, size_t payload_size,
+        uint32_t first, uint32_t last, bool reliable) {
+    if (spool_while_offline(client, SPOOL_DISPLAY, payload, payload_size)) {
+        return;
+    }
+    wait_for_display_lane();
+
+    if (reliable || (enabled_features & sling_feature_display_qos0) == 0) {
+        send_raw(client, "display", payload, payload_size);
+        return;
+    }
+
+    sling_window_add(display_window, first, last, payload, payload_size);
+    send_raw_qos(client, "display", payload, payload_size, 0);
 }
 
 static void send_hello(esp_mqtt_client_handle_t client) {
-    char buf[8];
+    char buf[12];
     uint32_to_char4(buf, msg_no++);
     uint32_to_char4(buf+4, esp_random());
+    uint32_to_char4(buf+8, SUPPORTED_FEATURES);
+
+    send_raw(client, "hello", buf, 12);
 
-    send_raw(client, "hello", buf, 8);
+    static bool first_hello = true;
+    if (first_hello) {
+        first_hello = false;
+        ESP_LOGI(TAG, "first hello %lld ms after boot", esp_timer_get_time() / 1000);
+    }
 }
 
-static void send_status(esp_mqtt_client_handle_t client, uint16_t status) {
-    struct sling_message_status *to_send = malloc(sizeof(struct sling_message_status));
-    to_send->message_counter = msg_no++;
-    to_send->status = status;
+static int send_status(esp_mqtt_client_handle_t client, uint16_t status) {
+    struct sling_message_status to_send = {
+        .message_counter = msg_no++,
+        .status = status,
+    };
+
+    return send_raw(client, "status", (char *) &to_send, sizeof(to_send));
+}
 
-    size_t buf_len = sizeof(*to_send);
-    char *buf = malloc(buf_len);
-    memcpy(buf, to_send, buf_len);
-    send_raw(client, "status", buf, buf_len);
-    free(to_send);
-    free(buf);
+static void send_stats(esp_mqtt_client_handle_t client) {
+    uint32_t hits, misses;
+    program_cache_stats(&hits, &misses);
+    struct sinter_display_stats display;
+    sinter_get_display_stats(&display);
+
+    struct sling_message_stats to_send = {
+        .message_counter = msg_no++,
+        .cache_hits = hits,
+        .cache_misses = misses,
+        .display_blocked = display.blocked,
+        .display_dropped = display.dropped,
+        .display_truncated = display.truncated,
+        .display_suppressed = display_suppressed,
+        .display_rate_msgs = display_msg_budget.rate,
+        .display_rate_bytes = display_byte_budget.rate,
+    };
+
+    send_raw(client, "stats", (char *) &to_send, sizeof(to_send));
+}
+
+static void handle_ping(esp_mqtt_event_handle_t event) {
+    ESP_LOGI(TAG, "got ping");
+
+    send_status(event->client, sling_message_status_type_idle);
+    send_stats(event->client);
+    ESP_LOGI(TAG, "sent status");
+}
+
+static void start_run(esp_mqtt_client_handle_t client, struct sling_run *run) {
+    ESP_LOGI(TAG, "starting to run...");
+    send_status(client, sling_message_status_type_running);
+    if (sling_run_start(run) != 0) { // error starting
+        send_status(client, sling_message_status_type_idle);
+    }
+}
+
+static void handle_run(esp_mqtt_event_handle_t event) {
+    if (event->current_data_offset == 0) {
+        ESP_LOGI(TAG, "got run (%d bytes)", event->total_data_len); // TODO check status before running
+    }
+
+    struct sling_run run;
+    if (sling_run_receive(event->data, event->data_len, event->current_data_offset, event->total_data_len, &run) == sling_run_ready) {
+        start_run(event->client, &run);
+    }
 }
 
-// don't forget to free the returned char[]
-static char *get_msg_type(char *topic, size_t size) {
-    char *buf = malloc(size + 1); // free?
-    strlcpy(buf, topic, size + 1);
+static void send_cache_miss(esp_mqtt_client_handle_t client, const uint8_t hash[PROGRAM_CACHE_HASH_SIZE]) {
+    ESP_LOGI(TAG, "program not cached, asking for upload");
+    struct sling_message_status_cache_miss to_send = {
+        .message_counter = msg_no++,
+        .status = sling_message_status_type_cache_miss,
+    };
+    memcpy(to_send.hash, hash, sizeof(to_send.hash));
+
+    send_raw(client, "status", (char *) &to_send, sizeof(to_send));
+}
+
+static void handle_run_result(esp_mqtt_client_handle_t client, enum sling_run_result result, struct sling_run *run) {
+    switch (result) {
+        case sling_run_ready:
+            start_run(client, run);
+            break;
+
+        case sling_run_cache_miss:
+            send_cache_miss(client, run->hash);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void handle_run_hash(esp_mqtt_event_handle_t event) {
+    ESP_LOGI(TAG, "got run_hash");
+
+    struct sling_run run;
+    handle_run_result(event->client, sling_run_from_cache(event->data, event->data_len, &run), &run);
+}
+
+static void handle_run_delta(esp_mqtt_event_handle_t event) {
+    ESP_LOGI(TAG, "got run_delta (%d bytes)", event->data_len);
+
+    struct sling_run run;
+    handle_run_result(event->client, sling_run_from_delta(event->data, event->data_len, &run), &run);
+}
+
+static void handle_stop(esp_mqtt_event_handle_t event) {
+    ESP_LOGI(TAG, "stopping sinter task...");
+    int64_t received_at = esp_timer_get_time();
+    sling_run_drop_pending();
+    stop_sinter();
+
+    // timed until the broker acks the idle status, in MQTT_EVENT_PUBLISHED
+    stop_reply_msg_id = send_status(event->client, sling_message_status_type_idle);
+    stop_received_at = received_at;
+}
+
+static void stop_reply_acked() {
+    int64_t latency = esp_timer_get_time() - stop_received_at;
+    if (latency < stop_latency_min) stop_latency_min = latency;
+    if (latency > stop_latency_max) stop_latency_max = latency;
+    ESP_LOGI(TAG, "stop acknowledged after %lld us (min %lld, max %lld)", latency, stop_latency_min, stop_latency_max);
+}
+
+static void handle_config(esp_mqtt_event_handle_t event) {
+    if (event->data_len < sizeof(struct sling_message_config)) {
+        ESP_LOGW(TAG, "config message too short (%d bytes)", event->data_len);
+        return;
+    }
+
+    struct sling_message_config option;
+    memcpy(&option, event->data, sizeof(option));
+    switch (option.key) {
+        case sling_config_display_overflow:
+            sinter_set_overflow_policy(option.value);
+            break;
+
+        case sling_config_display_rate_msgs:
+            ESP_LOGI(TAG, "display budget set to %d messages/s", option.value);
+            sling_rate_set(&display_msg_budget, option.value);
+            break;
+
+        case sling_config_display_rate_bytes:
+            ESP_LOGI(TAG, "display budget set to %d bytes/s", option.value);
+            sling_rate_set(&display_byte_budget, option.value);
+            break;
+
+        case sling_config_time_budget:
+            sling_run_set_time_budget(option.value);
+            break;
+
+        default:
+            ESP_LOGW(TAG, "unknown config key %d", option.key);
+            break;
+    }
+}
+
+static void handle_features(esp_mqtt_event_handle_t event) {
+    if (event->data_len < sizeof(struct sling_message_features)) {
+        ESP_LOGW(TAG, "features message too short (%d bytes)", event->data_len);
+        return;
+    }
+
+    struct sling_message_features features;
+    memcpy(&features, event->data, sizeof(features));
+    uint32_t requested = features.features & SUPPORTED_FEATURES;
+
+    if ((requested & sling_feature_display_qos0) && display_window == NULL) {
+        display_window = sling_window_create(DISPLAY_WINDOW_SIZE);
+        if (display_window == NULL) {
+            ESP_LOGW(TAG, "no memory for a retransmit window, staying at QoS 1");
+            requested &= ~sling_feature_display_qos0;
+        }
+    }
+
+    enabled_features = requested;
+    ESP_LOGI(TAG, "backend enabled features 0x%x", enabled_features);
+}
+
+static void resend_display(void *ctx, char *payload, size_t len) {
+    send_raw(ctx, "display", payload, len);
+}
+
+static void handle_retransmit(esp_mqtt_event_handle_t event) {
+    if (event->data_len < sizeof(struct sling_message_retransmit)) {
+        ESP_LOGW(TAG, "retransmit message too short (%d bytes)", event->data_len);
+        return;
+    }
+    if (display_window == NULL) {
+        return;
+    }
+
+    struct sling_message_retransmit request;
+    memcpy(&request, event->data, sizeof(request));
 
-    char *msg_type;
-    msg_type = strtok(buf, "/"); // client id. TODO potentially unsafe? Try strtok_r?
-    msg_type = strtok(NULL, "/");
+    // resent at QoS 1, since the backend is already waiting for them
+    size_t resent = sling_window_resend(display_window, request.first_counter, request.last_counter, resend_display, event->client);
+    ESP_LOGI(TAG, "resent %d display messages for %u-%u", resent, request.first_counter, request.last_counter);
+}
+
+struct topic_route {
+    const char *name;
+    void (*handler)(esp_mqtt_event_handle_t event);
+    // whether handler takes messages split over several MQTT_EVENT_DATAs
+    bool streaming;
+    // whether display output should make way for handler's replies
+    bool control;
+
+    // filled in by build_routes()
+    size_t name_len;
+    char topic[SLING_TOPIC_MAX];
+};
+
+// every inbound topic is <client id>/<name>
+static struct topic_route routes[] = {
+    { .name = SLING_INTOPIC_RUN, .handler = handle_run, .streaming = true },
+    { .name = SLING_INTOPIC_RUN_HASH, .handler = handle_run_hash },
+    { .name = SLING_INTOPIC_RUN_DELTA, .handler = handle_run_delta },
+    { .name = SLING_INTOPIC_STOP, .handler = handle_stop, .control = true },
+    { .name = SLING_INTOPIC_PING, .handler = handle_ping, .control = true },
+    { .name = SLING_INTOPIC_FEATURES, .handler = handle_features },
+    { .name = SLING_INTOPIC_CONFIG, .handler = handle_config },
+    { .name = SLING_INTOPIC_RETRANSMIT, .handler = handle_retransmit },
+};
+
+#define ROUTE_COUNT (sizeof(routes) / sizeof(routes[0]))
+
+// length of the "<client id>/" prefix shared by all routes
+static size_t route_prefix_len;
+
+// only the first fragment of a message carries its topic
+static struct topic_route *current_route;
+
+static void build_routes() {
+    route_prefix_len = strlen(config->client_id) + 1;
+
+    for (int i = 0; i < ROUTE_COUNT; i++) {
+        struct topic_route *route = &routes[i];
+        route->name_len = strlen(route->name);
+        snprintf(route->topic, sizeof(route->topic), "%s/%s", config->client_id, route->name);
+    }
+}
 
-    if (msg_type == NULL) {
+static struct topic_route *find_route(const char *topic, size_t topic_len) {
+    if (topic_len <= route_prefix_len || memcmp(topic, routes[0].topic, route_prefix_len) != 0) {
         return NULL;
-    } else {
-        char *ret = malloc(strlen(msg_type));
-        strcpy(ret, msg_type); // msg_type is null terminated
-        free(buf);
-        return ret;
     }
+
+    const char *name = topic + route_prefix_len;
+    size_t name_len = topic_len - route_prefix_len;
+    for (int i = 0; i < ROUTE_COUNT; i++) {
+        if (routes[i].name_len == name_len && memcmp(routes[i].name, name, name_len) == 0) {
+            return &routes[i];
+        }
+    }
+
+    return NULL;
 }
 
 static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
@@ -107,37 +497,43 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
     esp_mqtt_client_handle_t client = event->client;
     // your_context_t *context = event->context;
     switch (event->event_id) {
+        case MQTT_EVENT_BEFORE_CONNECT:
+            ESP_LOGI(TAG, "MQTT_EVENT_BEFORE_CONNECT");
+            connect_started_at = esp_timer_get_time();
+            heap_before_connect = esp_get_free_heap_size();
+            break;
+
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-            msg_no = 0;
-
-            {
-                size_t topic_sz = strlen(config->client_id) + 16;
-                char *topic = malloc(topic_sz);
-
-                snprintf(topic, topic_sz, "%s/run", config->client_id);
-                esp_mqtt_client_subscribe(client, topic, 1);
-
-                snprintf(topic, topic_sz, "%s/stop", config->client_id);
-                esp_mqtt_client_subscribe(client, topic, 1);
-
-                snprintf(topic, topic_sz, "%s/ping", config->client_id);
-                esp_mqtt_client_subscribe(client, topic, 1);
-
-                snprintf(topic, topic_sz, "%s/input", config->client_id);
-                esp_mqtt_client_subscribe(client, topic, 1);
-
-                ESP_LOGI(TAG, "subscribed to client topics");
-                free(topic);
-
-                send_hello(client);
-                ESP_LOGI(TAG, "sent hello message");
+            connect_count++;
+            // the low-water mark only counts as the handshake's peak if it was set during this connect
+            ESP_LOGI(TAG, "connect #%d took %lld ms; free heap %d before, %d after, %d lowest since boot",
+                connect_count, (esp_timer_get_time() - connect_started_at) / 1000,
+                heap_before_connect, esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+            // msg_no carries on, so output spooled while we were away still fits in the sequence
+            mqtt_connected = true;
+            xSemaphoreGive(reconnected);
+            enabled_features = 0; // might be an older backend now; wait for it to opt in again
+
+            // esp-mqtt only takes one filter per SUBSCRIBE, but none of these wait for their SUBACK
+            build_routes();
+            for (int i = 0; i < ROUTE_COUNT; i++) {
+                esp_mqtt_client_subscribe(client, routes[i].topic, 1);
             }
+            ESP_LOGI(TAG, "subscribed to client topics");
 
+            send_hello(client);
+            send_stats(client);
+            ESP_LOGI(TAG, "sent hello message");
             break;
 
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+            mqtt_connected = false;
+            // anything unacked is either resent by the outbox or gone; don't hold display output for it
+            portENTER_CRITICAL(&lane_lock);
+            publishes_in_flight = 0;
+            portEXIT_CRITICAL(&lane_lock);
             break;
 
         case MQTT_EVENT_SUBSCRIBED:
@@ -150,51 +546,57 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 
         case MQTT_EVENT_PUBLISHED:
             ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            portENTER_CRITICAL(&lane_lock);
+            if (publishes_in_flight > 0) {
+                publishes_in_flight--;
+            }
+            portEXIT_CRITICAL(&lane_lock);
+            xSemaphoreGive(publish_acked);
+
+            if (event->msg_id == stop_reply_msg_id) {
+                stop_reply_msg_id = -1;
+                stop_reply_acked();
+            }
             break;
 
         case MQTT_EVENT_DATA:
             {
-                ESP_LOGI(TAG, "Got message from topic %.*s\r\n", event->topic_len, event->topic);
+                struct topic_route *route;
+                if (event->current_data_offset == 0) {
+                    ESP_LOGI(TAG, "Got message from topic %.*s\r\n", event->topic_len, event->topic);
+                    route = current_route = find_route(event->topic, event->topic_len);
+                    if (route == NULL) {
+                        ESP_LOGW(TAG, "couldn't get message type -- malformed topic?");
+                        break;
+                    }
+                } else {
+                    route = current_route;
+                    if (route == NULL) {
+                        break;
+                    }
+                }
 
-                //printf("topic %s, len %d", event->topic, event->topic_len);
-                char *msg_type = get_msg_type(event->topic, event->topic_len);
-                if (msg_type == NULL) {
-                    ESP_LOGW(TAG, "couldn't get message type -- malformed topic?");
+                if (!route->streaming && event->data_len != event->total_data_len) {
+                    if (event->current_data_offset == 0) {
+                        ESP_LOGW(TAG, "%d byte message on %s too big, dropping", event->total_data_len, route->name);
+                    }
                     break;
                 }
-                size_t cmp_len = event->topic_len - strlen(config->client_id) - 2; // for the slash and null terminator
-                if (strncmp(msg_type, "ping", cmp_len) == 0) {
-                    ESP_LOGI(TAG, "got ping");
-
-                    send_status(client, sling_message_status_type_idle);
-                    ESP_LOGI(TAG, "sent status");
-                } else if (strncmp(msg_type, "run", cmp_len) == 0) {
-                    ESP_LOGI(TAG, "got run"); // TODO check status before running
-
-                    size_t size = event->data_len - 4;
-                    unsigned char *binary = malloc(size);
-                    memcpy(binary, event->data + 4, size);
-
-                    #ifdef SLING_MQTT_DEBUG
-                    printf("received program:\n");
-                    for (int i = 0; i < size; i++) {
-                        printf("%02x ", *(binary+i));
-                    }
-                    printf("\n");
-                    #endif
 
-                    ESP_LOGI(TAG, "starting to run...");
-                    send_status(client, sling_message_status_type_running);
-                    if (run_sinter(binary, size) != 0) { // error starting
-                        send_status(client, sling_message_status_type_idle);
-                    }
-                    free(binary);
-                } else if (strncmp(msg_type, "stop", cmp_len) == 0) {
-                    ESP_LOGI(TAG, "stopping sinter task...");
-                    stop_sinter();
-                    send_status(client, sling_message_status_type_idle);
+                if (route->control) {
+                    portENTER_CRITICAL(&lane_lock);
+                    control_pending++;
+                    portEXIT_CRITICAL(&lane_lock);
+                }
+
+                route->handler(event);
+
+                if (route->control) {
+                    portENTER_CRITICAL(&lane_lock);
+                    control_pending--;
+                    portEXIT_CRITICAL(&lane_lock);
+                    xSemaphoreGive(control_done);
                 }
-                free(msg_type);
             }
 
             break;
@@ -223,43 +625,212 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     mqtt_event_handler_cb(event_data);
 }
 
-static void buffer_poll_loop(esp_mqtt_client_handle_t client) {
-    size_t buffer_size = 0x800;
-    char *buffer = malloc(buffer_size);
-    if (buffer == NULL) {
-        ESP_LOGE(TAG, "Error allocating mbuf buffer.");
+// flush records carry the error bit on top of the type
+static bool is_flush(uint16_t display_type) {
+    return (display_type & ~sling_message_display_type_error) == sling_message_display_type_flush;
+}
+
+// results (and anything else self-flushing) never go out at QoS 0
+static bool is_reliable(uint16_t display_type) {
+    return !is_flush(display_type) && (display_type & sling_message_display_type_self_flushing);
+}
+
+static void flush_batch(esp_mqtt_client_handle_t client) {
+    struct sling_message_display_batch *batch = (struct sling_message_display_batch *) batch_buf;
+    if (batch->record_count == 0) {
         return;
     }
 
+    if (mqtt_connected && (enabled_features & sling_feature_display_batch)) {
+        send_display(client, batch_buf, batch_len, batch->message_counter, batch_last_counter, batch_reliable);
+    } else {
+        // the backend just opted out, or we're offline and this would be spooled. spooled output
+        // is replayed before the backend has had a chance to opt in again, so it goes record by record
+        char *record = batch->records;
+        for (uint16_t i = 0; i < batch->record_count; i++) {
+            uint16_t len;
+            memcpy(&len, record, sizeof(len));
+            record += sizeof(len);
+
+            struct sling_message_display *display = (struct sling_message_display *) record;
+            send_display(client, record, len, display->message_counter, display->message_counter,
+                         is_reliable(display->display_type));
+            record += len;
+        }
+    }
+    batch->record_count = 0;
+    batch_reliable = false;
+    batch_len = sizeof(*batch);
+}
+
+// returns false if the record can never fit in a batch
+static bool batch_record(char *record, size_t size) {
+    struct sling_message_display_batch *batch = (struct sling_message_display_batch *) batch_buf;
+    if (sizeof(*batch) + sizeof(uint16_t) + size > DISPLAY_BATCH_SIZE) {
+        return false;
+    }
+
+    struct sling_message_display *display = (struct sling_message_display *) record;
+    if (batch->record_count == 0) {
+        batch->message_counter = display->message_counter;
+        batch_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(DISPLAY_BATCH_TIMEOUT_MS);
+    }
+    batch_last_counter = display->message_counter;
+    batch_reliable |= is_reliable(display->display_type);
+
+    uint16_t len = size;
+    memcpy(batch_buf + batch_len, &len, sizeof(len));
+    memcpy(batch_buf + batch_len + sizeof(len), record, size);
+    batch_len += sizeof(len) + size;
+    batch->record_count++;
+    return true;
+}
+
+// stamps a display record and sends it, batched if the backend wants that
+static void publish_display(esp_mqtt_client_handle_t client, char *buffer, size_t size) {
+    struct sling_message_display *to_send = (struct sling_message_display *) buffer;
+    to_send->message_counter = msg_no++;
+
+    bool ends_batch = true;
+    if (is_flush(to_send->display_type)) {
+        struct sling_message_display_flush *to_send_flush = (struct sling_message_display_flush *) buffer;
+        to_send_flush->starting_id = display_start_counter;
+        display_start_counter = to_send_flush->message_counter;
+
+        needs_flush = false;
+    } else {
+        // if not a self-flushing message...
+        if ((to_send->display_type & sling_message_display_type_self_flushing) == 0) {
+            if (!needs_flush) {
+                needs_flush = true;
+                display_start_counter = to_send->message_counter;
+            }
+            ends_batch = false;
+        }
+    }
+
+    uint32_t counter = to_send->message_counter;
+    bool reliable = is_reliable(to_send->display_type);
+    if ((enabled_features & sling_feature_display_batch) == 0) {
+        flush_batch(client); // in case the backend just opted out
+        send_display(client, buffer, size, counter, counter, reliable);
+    } else {
+        if (batch_len + sizeof(uint16_t) + size > DISPLAY_BATCH_SIZE) {
+            flush_batch(client);
+        }
+        if (!batch_record(buffer, size)) {
+            // too big to batch, so it goes out on its own, straight from the ring
+            flush_batch(client);
+            send_display(client, buffer, size, counter, counter, reliable);
+        }
+        if (ends_batch) {
+            flush_batch(client);
+        }
+    }
+}
+
+// only plain output is ever suppressed; results and flushes always go out
+static bool is_suppressible(uint16_t display_type) {
+    display_type &= ~(sling_message_display_type_error | sling_message_display_type_continued);
+    return display_type == sling_message_display_type_output;
+}
+
+/**
+ * charges a display record to the output budget, or decides to suppress it
+ *
+ * a value split over several records is suppressed or sent as a whole, depending on its first record.
+ */
+static bool within_budget(struct sling_message_display *record, size_t size) {
+    bool continued = record->display_type & sling_message_display_type_continued;
+    if (suppressing_value) {
+        suppressing_value = continued;
+        return false;
+    }
+
+    bool allowed = sling_rate_allow(&display_msg_budget, 1) && sling_rate_allow(&display_byte_budget, size);
+    if (!allowed && !in_value && is_suppressible(record->display_type)) {
+        suppressed_lines++;
+        display_suppressed++;
+        suppressing_value = continued;
+        return false;
+    }
+
+    in_value = continued;
+    sling_rate_spend(&display_msg_budget, 1);
+    sling_rate_spend(&display_byte_budget, size);
+    return true;
+}
+
+// summarizes output suppressed since the last notice, once the budget allows
+static void send_suppressed_notice(esp_mqtt_client_handle_t client) {
+    if (suppressed_lines == 0 || !sling_rate_allow(&display_msg_budget, 1)) {
+        return;
+    }
+
+    char buf[sizeof(struct sling_message_display) + 48];
+    struct sling_message_display *notice = (struct sling_message_display *) buf;
+    size_t len = snprintf(notice->string, sizeof(buf) - sizeof(*notice), "[%u lines suppressed]", suppressed_lines);
+    // plain error output; self_flushing would make it read as the run ending in an error
+    notice->display_type = sling_message_display_type_error;
+    notice->data_type = sinter_type_string;
+    notice->string_length = len;
+
+    sling_rate_spend(&display_msg_budget, 1);
+    publish_display(client, buf, sizeof(*notice) + len + 1);
+    suppressed_lines = 0;
+}
+
+static void buffer_poll_loop(esp_mqtt_client_handle_t client) {
+    struct sling_message_display_batch *batch = (struct sling_message_display_batch *) batch_buf;
+    batch->display_type = sling_message_display_type_batch;
+    batch->record_count = 0;
+    batch_len = sizeof(*batch);
+
     while (1) {
-        size_t recv_size = xMessageBufferReceive(mbuf, buffer, buffer_size, portMAX_DELAY);
-        // recv_size == 0 if timeout or msg size > buffer_size
-        // also skip if message is smaller than expected
-        if (recv_size == 0 || recv_size < sizeof(struct sling_message_display_flush)) {
-            // TODO figure out what to do if we get a message >2KiB...?
+        TickType_t wait = portMAX_DELAY;
+        if (batch->record_count > 0) {
+            TickType_t now = xTaskGetTickCount();
+            wait = (int32_t) (batch_deadline - now) > 0 ? batch_deadline - now : 0;
+        }
+        if (suppressed_lines > 0 && wait > pdMS_TO_TICKS(SUPPRESSED_NOTICE_MS)) {
+            // the notice shouldn't have to wait for more output
+            wait = pdMS_TO_TICKS(SUPPRESSED_NOTICE_MS);
+        }
+        if (!spool_empty() && wait > pdMS_TO_TICKS(SPOOL_WAIT_MS)) {
+            // nor should the spool, once we're back
+            wait = pdMS_TO_TICKS(SPOOL_WAIT_MS);
+        }
+
+        size_t recv_size;
+        char *buffer = sling_ring_peek(display_ring, &recv_size, wait);
+        if (buffer == NULL) { // batch timed out
+            flush_batch(client);
+            if (mqtt_connected && !spool_empty()) {
+                spool_replay(replay_message, client);
+            }
+            if (!in_value) {
+                send_suppressed_notice(client);
+            }
+            continue;
+        }
+
+        // skip if message is smaller than expected
+        if (recv_size < sizeof(struct sling_message_display_flush)) {
+            sling_ring_release(display_ring);
             continue;
         }
 
+        // the record is stamped in place in its ring slot
         struct sling_message_display *to_send = (struct sling_message_display *) buffer;
-        to_send->message_counter = msg_no++;
-
-        if (to_send->display_type & sling_message_display_type_flush) {
-            struct sling_message_display_flush *to_send_flush = (struct sling_message_display_flush *) buffer;
-            to_send_flush->starting_id = display_start_counter;
-            display_start_counter = to_send_flush->message_counter;
-
-            needs_flush = false;
-        } else {
-            // if not a self-flushing message...
-            if ((to_send->display_type & sling_message_display_type_self_flushing) == 0) {
-                if (!needs_flush) {
-                    needs_flush = true;
-                    display_start_counter = to_send->message_counter;
-                }
+        bool starts_value = !in_value;
+        if (within_budget(to_send, recv_size)) {
+            if (starts_value) {
+                send_suppressed_notice(client);
             }
+            publish_display(client, buffer, recv_size);
         }
 
-        send_raw(client, "display", buffer, recv_size);
+        sling_ring_release(display_ring);
     }
 }
 
@@ -274,11 +845,21 @@ void sling_mqtt_start(struct sling_config *conf) {
     esp_log_level_set("TRANSPORT", ESP_LOG_VERBOSE);
     esp_log_level_set("OUTBOX", ESP_LOG_VERBOSE);
 
+    const uint8_t *cert, *key;
+    size_t cert_len, key_len;
+    if (!sling_creds_get(&cert, &cert_len, &key, &key_len)) {
+        ESP_LOGE(TAG, "No client credentials stored.");
+        return;
+    }
+
     const esp_mqtt_client_config_t mqtt_cfg = {
         .uri = config->broker_uri,
         .cert_pem = config->server_cert_ptr,
-        .client_cert_pem = config->client_cert,
-        .client_key_pem = config->client_key,
+        // DER, read straight out of the mapped creds partition
+        .client_cert_pem = (const char *) cert,
+        .client_cert_len = cert_len,
+        .client_key_pem = (const char *) key,
+        .client_key_len = key_len,
         .client_id = config->client_id,
         .buffer_size = 4096,
     };
@@ -287,7 +868,51 @@ void sling_mqtt_start(struct sling_config *conf) {
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
 
-    mbuf = xMessageBufferCreate(0x4000);
+    sling_rate_set(&display_msg_budget, DISPLAY_RATE_MSGS);
+    sling_rate_set(&display_byte_budget, DISPLAY_RATE_BYTES);
+
+    display_ring = sling_ring_create(DISPLAY_RING_SIZE);
+    batch_buf = malloc(DISPLAY_BATCH_SIZE);
+    control_done = xSemaphoreCreateBinary();
+    publish_acked = xSemaphoreCreateBinary();
+    reconnected = xSemaphoreCreateBinary();
+    if (display_ring == NULL || batch_buf == NULL || control_done == NULL || publish_acked == NULL || reconnected == NULL) {
+        ESP_LOGE(TAG, "Error allocating display ring.");
+        return;
+    }
+    if (sinter_task_init() != 0 || sling_run_init() != 0) {
+        return;
+    }
+    spool_init();
+
+    portENTER_CRITICAL(&client_lock);
+    bool stopped = mqtt_stopped;
+    portEXIT_CRITICAL(&client_lock);
+    if (stopped) {
+        ESP_LOGW(TAG, "Client stopped before it was started, not starting it");
+        return;
+    }
     esp_mqtt_client_start(client);
+
+    // a stop that came in while starting found no client, so it's ours to do
+    portENTER_CRITICAL(&client_lock);
+    mqtt_client = client;
+    stopped = mqtt_stopped;
+    portEXIT_CRITICAL(&client_lock);
+    if (stopped) {
+        esp_mqtt_client_stop(client);
+    }
+
     buffer_poll_loop(client);
 }
+
+void sling_mqtt_stop(void) {
+    portENTER_CRITICAL(&client_lock);
+    mqtt_stopped = true;
+    esp_mqtt_client_handle_t client = mqtt_client;
+    portEXIT_CRITICAL(&client_lock);
+
+    if (client != NULL) {
+        esp_mqtt_client_stop(client);
+    }
+}
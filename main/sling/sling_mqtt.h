@@ -1,3 +1,10 @@
 #include "sling.h"
 
-void sling_mqtt_start(struct sling_config *conf);
\ No newline at end of file
+void sling_mqtt_start(struct sling_config *conf);
+
+/**
+ * stops the client for good, so it's no longer reading the stored credentials
+ *
+ * returns once it's stopped. if it hasn't been started yet, it never will be.
+ */
+void sling_mqtt_stop(void);
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+#include "sling_rate.h"
+
+// buckets are set from the MQTT task while the publisher spends from them; one lock covers them all
+static portMUX_TYPE rate_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void sling_rate_set(struct sling_rate *bucket, uint32_t rate) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&rate_lock);
+    bucket->rate = rate;
+    bucket->tokens = rate;
+    bucket->refilled_at = now;
+    portEXIT_CRITICAL(&rate_lock);
+}
+
+// rate_lock must be held, and rate not 0
+static void refill(struct sling_rate *bucket, int64_t now) {
+    // whole tokens only, so the remainder keeps accruing instead of being lost
+    int64_t earned = (now - bucket->refilled_at) * bucket->rate / 1000000;
+    if (earned <= 0) {
+        return;
+    }
+
+    bucket->refilled_at += earned * 1000000 / bucket->rate;
+    bucket->tokens += earned;
+    if (bucket->tokens >= bucket->rate) {
+        bucket->tokens = bucket->rate;
+        bucket->refilled_at = now;
+    }
+}
+
+bool sling_rate_allow(struct sling_rate *bucket, uint32_t n) {
+    int64_t now = esp_timer_get_time();
+    bool allowed = true;
+
+    portENTER_CRITICAL(&rate_lock);
+    if (bucket->rate != 0) {
+        refill(bucket, now);
+        // anything bigger than the bucket goes through once it's full
+        allowed = bucket->tokens >= (n < bucket->rate ? n : bucket->rate);
+    }
+    portEXIT_CRITICAL(&rate_lock);
+    return allowed;
+}
+
+void sling_rate_spend(struct sling_rate *bucket, uint32_t n) {
+    portENTER_CRITICAL(&rate_lock);
+    if (bucket->rate != 0) {
+        bucket->tokens -= n;
+    }
+    portEXIT_CRITICAL(&rate_lock);
+}
@@ -0,0 +1,28 @@
+#ifndef SLING_RATE_H
+#define SLING_RATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * token bucket, refilled continuously at rate tokens per second, holding up to a second's worth
+ *
+ * tokens can go negative when something is sent regardless of the budget, which then has to be
+ * paid back before anything else is allowed through. safe to set from one task while another
+ * spends.
+ */
+struct sling_rate {
+    // 0 for no limit
+    uint32_t rate;
+    int64_t tokens;
+    int64_t refilled_at;
+};
+
+void sling_rate_set(struct sling_rate *bucket, uint32_t rate);
+
+// whether n tokens are available right now
+bool sling_rate_allow(struct sling_rate *bucket, uint32_t n);
+
+void sling_rate_spend(struct sling_rate *bucket, uint32_t n);
+
+#endif
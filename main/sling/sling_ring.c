@@ -0,0 +1,222 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "sling_ring.h"
+
+static const char *TAG = "sling_ring";
+
+// marks the rest of the buffer as unused; the next record starts at offset 0
+#define RING_WRAP 0x7fffffff
+
+struct ring_hdr {
+    uint32_t size : 31;
+    // set by the producer; only these records are ever dropped
+    uint32_t droppable : 1;
+};
+
+struct sling_ring {
+    uint8_t *buf;
+    size_t size;
+
+    // head is only written by the producer, tail only by the consumer
+    size_t head;
+    size_t tail;
+    // set while the consumer holds the record at tail, which then can't be dropped
+    bool held;
+    portMUX_TYPE lock;
+
+    // offset of the outstanding reservation, if any
+    size_t reserved;
+    size_t reserved_size;
+
+    SemaphoreHandle_t data_avail;
+    SemaphoreHandle_t space_avail;
+};
+
+static inline size_t record_size(size_t size) {
+    return (sizeof(struct ring_hdr) + size + 3) & ~(size_t) 3;
+}
+
+static inline struct ring_hdr *hdr_at(struct sling_ring *ring, size_t offset) {
+    return (struct ring_hdr *) (ring->buf + offset);
+}
+
+struct sling_ring *sling_ring_create(size_t size) {
+    size &= ~(size_t) 3;
+
+    struct sling_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->buf = malloc(size);
+    ring->data_avail = xSemaphoreCreateBinary();
+    ring->space_avail = xSemaphoreCreateBinary();
+    if (ring->buf == NULL || ring->data_avail == NULL || ring->space_avail == NULL) {
+        ESP_LOGE(TAG, "Error allocating %d byte ring", size);
+        free(ring->buf);
+        if (ring->data_avail) vSemaphoreDelete(ring->data_avail);
+        if (ring->space_avail) vSemaphoreDelete(ring->space_avail);
+        free(ring);
+        return NULL;
+    }
+
+    ring->size = size;
+    vPortCPUInitializeMutex(&ring->lock);
+    return ring;
+}
+
+size_t sling_ring_max_size(struct sling_ring *ring) {
+    // record_size(size) must stay below ring->size
+    return ring->size - sizeof(struct ring_hdr) - 4;
+}
+
+/**
+ * find a contiguous slot for a record of `need` bytes (header included)
+ *
+ * head == tail always means empty, so a slot may never make head catch up with tail.
+ * returns the offset of the slot, or -1 if there's no room right now.
+ */
+static int find_slot(struct sling_ring *ring, size_t need, bool *wraps) {
+    portENTER_CRITICAL(&ring->lock);
+    if (ring->head == ring->tail) {
+        // empty; start over from the beginning so the whole ring is contiguous again
+        ring->head = 0;
+        ring->tail = 0;
+    }
+    size_t head = ring->head;
+    size_t tail = ring->tail;
+    portEXIT_CRITICAL(&ring->lock);
+
+    *wraps = false;
+    if (head >= tail) {
+        size_t at_end = ring->size - head;
+        if (need < at_end || (need == at_end && tail != 0)) {
+            return head;
+        }
+        if (need < tail) {
+            *wraps = true;
+            return 0;
+        }
+    } else if (need < tail - head) {
+        return head;
+    }
+
+    return -1;
+}
+
+void *sling_ring_reserve(struct sling_ring *ring, size_t size, TickType_t ticks_to_wait) {
+    size_t need = record_size(size);
+    if (need >= ring->size) {
+        return NULL;
+    }
+
+    TickType_t start = xTaskGetTickCount();
+    bool wraps;
+    int offset;
+    while ((offset = find_slot(ring, need, &wraps)) < 0) {
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (ticks_to_wait != portMAX_DELAY && waited >= ticks_to_wait) {
+            return NULL;
+        }
+        xSemaphoreTake(ring->space_avail, ticks_to_wait == portMAX_DELAY ? portMAX_DELAY : ticks_to_wait - waited);
+    }
+
+    if (wraps) {
+        // the consumer never reads past head, so this is safe to write before committing
+        hdr_at(ring, ring->head)->size = RING_WRAP;
+    }
+
+    ring->reserved = offset;
+    ring->reserved_size = size;
+    return hdr_at(ring, offset) + 1;
+}
+
+void sling_ring_commit(struct sling_ring *ring, size_t size, bool droppable) {
+    configASSERT(size <= ring->reserved_size);
+
+    hdr_at(ring, ring->reserved)->size = size;
+    hdr_at(ring, ring->reserved)->droppable = droppable;
+
+    size_t head = ring->reserved + record_size(size);
+    if (head == ring->size) {
+        head = 0;
+    }
+
+    portENTER_CRITICAL(&ring->lock);
+    ring->head = head;
+    portEXIT_CRITICAL(&ring->lock);
+
+    xSemaphoreGive(ring->data_avail);
+}
+
+void *sling_ring_peek(struct sling_ring *ring, size_t *size, TickType_t ticks_to_wait) {
+    while (1) {
+        portENTER_CRITICAL(&ring->lock);
+        size_t head = ring->head;
+        size_t tail = ring->tail;
+        ring->held = head != tail;
+        portEXIT_CRITICAL(&ring->lock);
+
+        if (head == tail) {
+            if (xSemaphoreTake(ring->data_avail, ticks_to_wait) != pdTRUE) {
+                return NULL;
+            }
+            continue;
+        }
+
+        struct ring_hdr *hdr = hdr_at(ring, tail);
+        if (hdr->size == RING_WRAP) {
+            portENTER_CRITICAL(&ring->lock);
+            ring->tail = 0;
+            ring->held = false;
+            portEXIT_CRITICAL(&ring->lock);
+            continue;
+        }
+
+        *size = hdr->size;
+        return hdr + 1;
+    }
+}
+
+void sling_ring_release(struct sling_ring *ring) {
+    size_t tail = ring->tail + record_size(hdr_at(ring, ring->tail)->size);
+    if (tail == ring->size) {
+        tail = 0;
+    }
+
+    portENTER_CRITICAL(&ring->lock);
+    ring->tail = tail;
+    ring->held = false;
+    portEXIT_CRITICAL(&ring->lock);
+
+    xSemaphoreGive(ring->space_avail);
+}
+
+bool sling_ring_drop_oldest(struct sling_ring *ring) {
+    portENTER_CRITICAL(&ring->lock);
+    bool dropped = false;
+    if (!ring->held && ring->head != ring->tail) {
+        size_t tail = ring->tail;
+        if (hdr_at(ring, tail)->size == RING_WRAP) {
+            tail = 0;
+        }
+
+        // a wrap marker is only ever followed by a record, so tail can't have been head
+        if (hdr_at(ring, tail)->droppable) {
+            tail += record_size(hdr_at(ring, tail)->size);
+            if (tail == ring->size) {
+                tail = 0;
+            }
+            ring->tail = tail;
+            dropped = true;
+        }
+    }
+    portEXIT_CRITICAL(&ring->lock);
+
+    return dropped;
+}
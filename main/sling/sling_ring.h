@@ -0,0 +1,56 @@
+#ifndef SLING_RING_H
+#define SLING_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+
+/**
+ * single-producer, single-consumer ring of variable-sized records
+ *
+ * the producer reserves a contiguous slot, serializes into it in place, then commits it;
+ * the consumer peeks the oldest record, uses it in place, then releases it.
+ * no record is ever copied by the ring itself.
+ */
+struct sling_ring;
+
+struct sling_ring *sling_ring_create(size_t size);
+
+// largest record the ring can ever hold
+size_t sling_ring_max_size(struct sling_ring *ring);
+
+/**
+ * reserve a contiguous slot of at least `size` bytes, waiting up to `ticks_to_wait` for space
+ *
+ * returns NULL on timeout, or if `size` could never fit in the ring.
+ * only one reservation may be outstanding at a time.
+ */
+void *sling_ring_reserve(struct sling_ring *ring, size_t size, TickType_t ticks_to_wait);
+
+/**
+ * publish the outstanding reservation to the consumer
+ *
+ * `size` may be smaller than what was reserved, but never larger. only `droppable` records
+ * may be discarded by sling_ring_drop_oldest().
+ */
+void sling_ring_commit(struct sling_ring *ring, size_t size, bool droppable);
+
+/**
+ * get the oldest committed record, waiting up to `ticks_to_wait` for one
+ *
+ * returns NULL on timeout. the record stays valid until sling_ring_release().
+ */
+void *sling_ring_peek(struct sling_ring *ring, size_t *size, TickType_t ticks_to_wait);
+
+void sling_ring_release(struct sling_ring *ring);
+
+/**
+ * called by the producer to discard the oldest committed record, freeing its space
+ *
+ * returns false if there's nothing to drop, the oldest record wasn't committed as droppable,
+ * or the consumer is using it right now.
+ */
+bool sling_ring_drop_oldest(struct sling_ring *ring);
+
+#endif
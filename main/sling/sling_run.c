@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include <mbedtls/sha256.h>
+#include "esp32/rom/miniz.h"
+
+#include "sling_run.h"
+#include "sling_message.h"
+
+static const char *TAG = "sling_run";
+
+// time a program may spend running before it's cancelled; 0 for no limit
+static volatile uint32_t time_budget_ms;
+
+#define CACHE_QUEUE_LENGTH 2
+// how long cache_task waits for a program before saving the cache's LRU order
+#define CACHE_FLUSH_MS 60000
+
+// program being received on the run topic, possibly over several MQTT_EVENT_DATAs
+static struct sling_run pending;
+static size_t pending_received;
+// bytes of the program written so far; differs from pending_received if it's compressed
+static size_t pending_written;
+// only set while receiving a compressed program
+static tinfl_decompressor *pending_inflate;
+static mbedtls_sha256_context pending_sha;
+
+// programs waiting to be written to flash, each holding a reference to its arena
+static QueueHandle_t cache_queue;
+
+static void cache_task(void *pvParams) {
+    while (1) {
+        struct sling_run run;
+        if (xQueueReceive(cache_queue, &run, pdMS_TO_TICKS(CACHE_FLUSH_MS)) != pdTRUE) {
+            program_cache_flush();
+            continue;
+        }
+
+        program_cache_put(run.hash, run.params->code, run.params->code_size);
+        run_arena_release(run.arena);
+    }
+}
+
+int sling_run_init(void) {
+    if (program_cache_init() != 0) {
+        // keep going; every run_hash will just be a miss
+        return 0;
+    }
+
+    cache_queue = xQueueCreate(CACHE_QUEUE_LENGTH, sizeof(struct sling_run));
+    if (cache_queue == NULL) {
+        return 1;
+    }
+
+    // low priority, so flash writes happen when nothing else needs core 0
+    BaseType_t result = xTaskCreatePinnedToCore(cache_task,
+        "cache_task",
+        3072,
+        NULL,
+        1,
+        NULL,
+        0);
+
+    if (result != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start cache_task with result %d. Out of heap space?", result);
+        return 1;
+    }
+
+    return 0;
+}
+
+// allocates the arena and params for a program of code_size bytes
+static bool alloc_run(struct sling_run *run, size_t code_size) {
+    if (code_size > SLING_RUN_CODE_MAX) {
+        ESP_LOGE(TAG, "program is %d bytes, more than the %d we allow", code_size, SLING_RUN_CODE_MAX);
+        run->arena = NULL;
+        return false;
+    }
+
+    size_t params_size = sizeof(struct sinter_run_params) + code_size;
+
+    run->arena = run_arena_create(params_size);
+    run->params = run->arena ? run_arena_alloc(run->arena, params_size) : NULL;
+    if (run->params == NULL) {
+        ESP_LOGE(TAG, "Error allocating %d bytes for program", code_size);
+        ESP_LOGE(TAG, "Free heap size: %d, min free heap size since boot: %d", xPortGetFreeHeapSize(), xPortGetMinimumEverFreeHeapSize());
+        run_arena_release(run->arena);
+        run->arena = NULL;
+        return false;
+    }
+
+    run->params->code_size = code_size;
+    run->params->time_budget_ms = time_budget_ms;
+    run->cache = false;
+    return true;
+}
+
+void sling_run_drop_pending(void) {
+    if (pending.arena != NULL) {
+        mbedtls_sha256_free(&pending_sha);
+    }
+    free(pending_inflate);
+    pending_inflate = NULL;
+    run_arena_release(pending.arena);
+    pending.arena = NULL;
+    pending.params = NULL;
+}
+
+// checks for a sling_message_run_compressed header, which has to be in the first fragment
+static bool is_compressed(const char *data, size_t len, struct sling_message_run_compressed *header) {
+    if (len < SLING_RUN_PREFIX_SIZE + sizeof(*header)) {
+        return false;
+    }
+    memcpy(header, data + SLING_RUN_PREFIX_SIZE, sizeof(*header));
+    return header->magic == SLING_RUN_COMPRESSED_MAGIC;
+}
+
+static bool start_pending(const char *data, size_t len, size_t total) {
+    struct sling_message_run_compressed header;
+    size_t code_size = total - SLING_RUN_PREFIX_SIZE;
+    if (is_compressed(data, len, &header)) {
+        // the inflater's tables are only needed while receiving, so they stay out of the run's arena
+        pending_inflate = malloc(sizeof(*pending_inflate));
+        if (pending_inflate == NULL) {
+            ESP_LOGE(TAG, "Error allocating decompressor");
+            return false;
+        }
+        tinfl_init(pending_inflate);
+        code_size = header.size;
+    }
+
+    // the only copy of the program; handed over to the VM as is, along with its arena
+    if (!alloc_run(&pending, code_size)) {
+        free(pending_inflate);
+        pending_inflate = NULL;
+        return false;
+    }
+    pending_received = 0;
+    pending_written = 0;
+
+    // hashed as it arrives, so it can be cached without another pass over it
+    mbedtls_sha256_init(&pending_sha);
+    mbedtls_sha256_starts_ret(&pending_sha, 0);
+    return true;
+}
+
+// inflates a chunk of the zlib stream straight into the program
+static bool inflate_chunk(const char *data, size_t len, bool more) {
+    size_t in_size = len;
+    size_t out_size = pending.params->code_size - pending_written;
+    unsigned char *out = pending.params->code + pending_written;
+
+    mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF;
+    if (more) {
+        flags |= TINFL_FLAG_HAS_MORE_INPUT;
+    }
+    tinfl_status status = tinfl_decompress(pending_inflate, (const mz_uint8 *) data, &in_size,
+        pending.params->code, out, &out_size, flags);
+
+    pending_written += out_size;
+    if (more ? status != TINFL_STATUS_NEEDS_MORE_INPUT : status != TINFL_STATUS_DONE) {
+        ESP_LOGE(TAG, "Error decompressing program (status %d)", status);
+        return false;
+    }
+    return true;
+}
+
+enum sling_run_result sling_run_receive(const char *data, size_t len, size_t offset, size_t total, struct sling_run *run) {
+    if (offset == 0) {
+        if (pending.arena != NULL) {
+            ESP_LOGW(TAG, "previous program was never fully received, dropping it");
+            sling_run_drop_pending();
+        }
+
+        if (total < SLING_RUN_PREFIX_SIZE) {
+            ESP_LOGW(TAG, "run message too short (%d bytes)", total);
+            return sling_run_error;
+        }
+
+        if (!start_pending(data, len, total)) {
+            return sling_run_error;
+        }
+    }
+
+    if (pending.arena == NULL) { // rest of a message we already gave up on
+        return sling_run_incomplete;
+    }
+
+    if (offset != pending_received || offset + len > total) {
+        ESP_LOGE(TAG, "got run fragment at %d, expected %d; dropping program", offset, pending_received);
+        sling_run_drop_pending();
+        return sling_run_error;
+    }
+
+    // use whatever part of this fragment lies past the prefix (and compression header)
+    size_t header_size = SLING_RUN_PREFIX_SIZE + (pending_inflate ? sizeof(struct sling_message_run_compressed) : 0);
+    size_t skip = offset < header_size ? header_size - offset : 0;
+    pending_received += len;
+    if (skip < len) {
+        unsigned char *out = pending.params->code + pending_written;
+        if (pending_inflate != NULL) {
+            if (!inflate_chunk(data + skip, len - skip, pending_received < total)) {
+                sling_run_drop_pending();
+                return sling_run_error;
+            }
+        } else {
+            memcpy(out, data + skip, len - skip);
+            pending_written += len - skip;
+        }
+        mbedtls_sha256_update_ret(&pending_sha, out, pending.params->code + pending_written - out);
+    }
+
+    if (pending_received < total) {
+        return sling_run_incomplete;
+    }
+
+    if (pending_written != pending.params->code_size) {
+        ESP_LOGE(TAG, "program is %d bytes, expected %d; dropping it", pending_written, pending.params->code_size);
+        sling_run_drop_pending();
+        return sling_run_error;
+    }
+
+    if (pending_inflate != NULL) {
+        ESP_LOGI(TAG, "inflated %d byte program from %d bytes", pending_written, total);
+        free(pending_inflate);
+        pending_inflate = NULL;
+    }
+
+    mbedtls_sha256_finish_ret(&pending_sha, pending.hash);
+    mbedtls_sha256_free(&pending_sha);
+    pending.cache = true;
+
+    *run = pending;
+    pending.arena = NULL;
+    pending.params = NULL;
+
+    #ifdef SLING_MQTT_DEBUG
+    printf("received program:\n");
+    for (int i = 0; i < run->params->code_size; i++) {
+        printf("%02x ", run->params->code[i]);
+    }
+    printf("\n");
+    #endif
+
+    return sling_run_ready;
+}
+
+enum sling_run_result sling_run_from_cache(const char *data, size_t len, struct sling_run *run) {
+    if (len < SLING_RUN_PREFIX_SIZE + PROGRAM_CACHE_HASH_SIZE) {
+        ESP_LOGW(TAG, "run_hash message too short (%d bytes)", len);
+        return sling_run_error;
+    }
+
+    memcpy(run->hash, data + SLING_RUN_PREFIX_SIZE, PROGRAM_CACHE_HASH_SIZE);
+
+    size_t size;
+    if (!program_cache_lookup(run->hash, &size)) {
+        return sling_run_cache_miss;
+    }
+
+    if (!alloc_run(run, size)) {
+        return sling_run_error;
+    }
+
+    if (program_cache_read(run->hash, run->params->code, size) != 0) {
+        run_arena_release(run->arena);
+        return sling_run_cache_miss;
+    }
+
+    return sling_run_ready;
+}
+
+static bool read_u32(const char **ops, const char *end, uint32_t *val) {
+    if (end - *ops < sizeof(*val)) {
+        return false;
+    }
+    memcpy(val, *ops, sizeof(*val));
+    *ops += sizeof(*val);
+    return true;
+}
+
+// builds code from base and the ops in [ops, end); returns false if they don't describe exactly code_size bytes
+static bool apply_delta(const unsigned char *base, size_t base_size, const char *ops, const char *end,
+        unsigned char *code, size_t code_size) {
+    size_t out = 0;
+    while (ops < end) {
+        uint8_t op = *ops++;
+        uint32_t offset, length;
+
+        switch (op) {
+            case sling_delta_op_copy:
+                if (!read_u32(&ops, end, &offset) || !read_u32(&ops, end, &length)
+                        || offset > base_size || length > base_size - offset || length > code_size - out) {
+                    return false;
+                }
+                memcpy(code + out, base + offset, length);
+                break;
+
+            case sling_delta_op_insert:
+                if (!read_u32(&ops, end, &length) || length > end - ops || length > code_size - out) {
+                    return false;
+                }
+                memcpy(code + out, ops, length);
+                ops += length;
+                break;
+
+            default:
+                ESP_LOGW(TAG, "unknown delta op %d", op);
+                return false;
+        }
+        out += length;
+    }
+
+    return out == code_size;
+}
+
+enum sling_run_result sling_run_from_delta(const char *data, size_t len, struct sling_run *run) {
+    struct sling_message_run_delta delta;
+    if (len < SLING_RUN_PREFIX_SIZE + sizeof(delta)) {
+        ESP_LOGW(TAG, "run_delta message too short (%d bytes)", len);
+        return sling_run_error;
+    }
+
+    memcpy(&delta, data + SLING_RUN_PREFIX_SIZE, sizeof(delta));
+    memcpy(run->hash, delta.target_hash, PROGRAM_CACHE_HASH_SIZE);
+
+    // apply_delta() bounds its writes by target_size, so it has to be one we'd actually allocate
+    if (delta.target_size > SLING_RUN_CODE_MAX) {
+        ESP_LOGW(TAG, "run_delta target is %u bytes, more than the %d we allow", delta.target_size, SLING_RUN_CODE_MAX);
+        return sling_run_error;
+    }
+
+    // the base only lives until the target is built, so it stays out of the run's arena
+    size_t base_size;
+    if (!program_cache_lookup(delta.base_hash, &base_size)) {
+        return sling_run_cache_miss;
+    }
+    unsigned char *base = malloc(base_size ? base_size : 1);
+    if (base == NULL) {
+        ESP_LOGE(TAG, "Error allocating %d bytes for delta base", base_size);
+        return sling_run_error;
+    }
+    if (program_cache_read(delta.base_hash, base, base_size) != 0) {
+        free(base);
+        return sling_run_cache_miss;
+    }
+
+    if (!alloc_run(run, delta.target_size)) {
+        free(base);
+        return sling_run_error;
+    }
+
+    const char *ops = data + SLING_RUN_PREFIX_SIZE + sizeof(delta);
+    bool applied = apply_delta(base, base_size, ops, data + len, run->params->code, run->params->code_size);
+    free(base);
+
+    uint8_t actual[PROGRAM_CACHE_HASH_SIZE];
+    if (applied) {
+        mbedtls_sha256_ret(run->params->code, run->params->code_size, actual, 0);
+    }
+    if (!applied || memcmp(actual, run->hash, PROGRAM_CACHE_HASH_SIZE) != 0) {
+        // most likely built against a different base than the backend thinks; have it resend in full
+        ESP_LOGW(TAG, "run_delta didn't produce the expected program");
+        run_arena_release(run->arena);
+        return sling_run_cache_miss;
+    }
+
+    ESP_LOGI(TAG, "rebuilt %d byte program from %d byte delta", run->params->code_size, len);
+    run->cache = true;
+    return sling_run_ready;
+}
+
+void sling_run_set_time_budget(uint32_t ms) {
+    time_budget_ms = ms;
+    ESP_LOGI(TAG, "time budget set to %u ms", ms);
+}
+
+int sling_run_start(struct sling_run *run) {
+    if (run->cache && cache_queue != NULL) {
+        // the VM only reads the program, so it can be written out while it runs
+        run_arena_retain(run->arena);
+        if (xQueueSend(cache_queue, run, 0) != pdTRUE) {
+            ESP_LOGW(TAG, "cache_task busy, not caching program");
+            run_arena_release(run->arena);
+        }
+    }
+
+    return run_sinter(run->arena, run->params);
+}
@@ -0,0 +1,68 @@
+#ifndef SLING_RUN_H
+#define SLING_RUN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../sinter/run_arena.h"
+#include "../sinter/sinter_task.h"
+#include "../storage/program_cache.h"
+
+// run messages start with 4 bytes we don't use, followed by the payload
+#define SLING_RUN_PREFIX_SIZE 4
+
+// largest program we'll allocate for; sizes come from the backend, so they're checked against this first
+#define SLING_RUN_CODE_MAX (256 * 1024)
+
+// a program that's fully in memory, ready to go to the VM
+struct sling_run {
+    struct run_arena *arena;
+    struct sinter_run_params *params;
+    // set if the program should be added to the cache once it's started
+    bool cache;
+    uint8_t hash[PROGRAM_CACHE_HASH_SIZE];
+};
+
+enum sling_run_result {
+    sling_run_incomplete = 0, // waiting for more fragments
+    sling_run_ready,
+    sling_run_error,
+    sling_run_cache_miss,
+};
+
+int sling_run_init(void);
+
+/**
+ * feeds one fragment of a run message (prefix, then raw or compressed bytecode) to the receiver
+ *
+ * on sling_run_ready, *run holds the program
+ */
+enum sling_run_result sling_run_receive(const char *data, size_t len, size_t offset, size_t total, struct sling_run *run);
+
+/**
+ * loads the program named by a run_hash message (prefix, then SHA-256 of the bytecode) from the cache
+ *
+ * on sling_run_cache_miss, the backend has to fall back to uploading the whole program
+ */
+enum sling_run_result sling_run_from_cache(const char *data, size_t len, struct sling_run *run);
+
+/**
+ * rebuilds the program described by a run_delta message from the cached base it's relative to
+ *
+ * on sling_run_cache_miss, run->hash is the program the backend has to upload in full.
+ * deltas have to fit in a single MQTT buffer; bigger ones are dropped, so the backend should
+ * just send the whole program then.
+ */
+enum sling_run_result sling_run_from_delta(const char *data, size_t len, struct sling_run *run);
+
+// drops a partially received program, if any
+void sling_run_drop_pending(void);
+
+// sets the time budget for runs from now on; see sling_config_time_budget
+void sling_run_set_time_budget(uint32_t ms);
+
+// hands the program over to the VM, and caches it in the background if needed
+int sling_run_start(struct sling_run *run);
+
+#endif
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -7,73 +9,71 @@
 #include <esp_log.h>
 #include <esp_http_client.h>
 #include <esp_tls.h>
-#include <nvs_flash.h>
+#include <esp_timer.h>
+#include <esp_rom_crc.h>
 
 #include "uuidgen.h"
 #include "sling.h"
+#include "sling_creds.h"
+#include "sling_mqtt.h"
+#include "../storage/config_store.h"
 
-#define NVS_NAMESPACE "sling"
-
-#define MAX_HTTP_RECV_BUFFER 512
-#define MAX_HTTP_OUTPUT_BUFFER 2048
+#define CONFIG_CACHE_PATH "/user_cfg/sling_config"
+#define CONFIG_CACHE_MAGIC 0x32434c53 // "SLC2"
+#define CONFIG_CACHE_CRC_SIZE (sizeof(struct config_cache) - offsetof(struct config_cache, secret))
 
 static const char *TAG = "sling_setup";
 
+#define HTTP_RETRY_MS 5000
+// revalidation runs alongside MQTT, so rather than retry forever it backs off from HTTP_RETRY_MS
+// and gives up until the next boot after this many tries at a GET
+#define REVALIDATE_ATTEMPTS 5
+
 // not sure why the *_end stuff is needed, but yolo
 extern const uint8_t sfs_root_g2_crt_start[]        asm("_binary_sfs_root_g2_crt_start");
 extern const uint8_t sfs_root_g2_crt_end[]          asm("_binary_sfs_root_g2_crt_end");
 extern const uint8_t verisign_pca3_g5_crt_start[]   asm("_binary_verisign_pca3_g5_crt_start");
 extern const uint8_t verisign_pca3_g5_crt_end[]     asm("_binary_verisign_pca3_g5_crt_end");
 
-// handle must already be opened
-static esp_err_t gen_secret(nvs_handle_t handle, char *uuid) {
-    esp_err_t err;
-
-    UUIDGen(uuid);
-    
-    err = nvs_set_str(handle, "secret", uuid);
-
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Got error %s while saving Sling secret to NVS", esp_err_to_name(err));
-    }
-
-    return err;
-}
-
 // make sure char *uuid is at least 37 bytes long (incl null terminator)
 void sling_get_secret(char *uuid) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-
-    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Got error %s while opening NVS namespace", esp_err_to_name(err));
-        uuid = NULL;
-        nvs_close(nvs_handle);
+    struct config config;
+    config_store_get(&config);
+    if (config.sling.secret[0] != '\0') {
+        strlcpy(uuid, config.sling.secret, 37);
         return;
     }
 
-    size_t size = 37;
-    err = nvs_get_str(nvs_handle, "secret", uuid, &size);
-    if (err == ESP_ERR_NVS_NOT_FOUND) {
-        err = gen_secret(nvs_handle, uuid);
+    struct config *staged = config_store_begin();
+    // unless another task got here first
+    if (staged->sling.secret[0] == '\0') {
+        UUIDGen(staged->sling.secret);
+    }
+    strlcpy(uuid, staged->sling.secret, 37);
 
-        if (err != ESP_OK) {
-            uuid = NULL;
-            nvs_close(nvs_handle);
-            return;
-        }
-    } else if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Got error %s while retrieving Sling secret from NVS", esp_err_to_name(err));
-        uuid = NULL;
-        nvs_close(nvs_handle);
-        return;
+    if (config_store_commit() != 0) {
+        ESP_LOGE(TAG, "Couldn't save Sling secret to NVS");
     }
 }
 
+/**
+ * where the body of the current response goes
+ *
+ * responses are written straight into the sling_config field they're for, so nothing bigger than
+ * the field is ever buffered. a body that doesn't fit sets overflow instead of being cut off,
+ * since a truncated cert or key is of no use.
+ */
+struct http_sink {
+    char *buf;
+    // including the null terminator
+    size_t cap;
+    size_t len;
+    bool overflow;
+};
+
 static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 {
-    static int output_len;       // Stores number of bytes read
+    struct http_sink *sink = evt->user_data;
     switch(evt->event_id) {
         case HTTP_EVENT_ERROR:
             ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
@@ -86,30 +86,23 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
             break;
         case HTTP_EVENT_ON_HEADER:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+            // headers of a new response (e.g. after a redirect) start the body over
+            sink->len = 0;
+            sink->overflow = false;
             break;
         case HTTP_EVENT_ON_DATA:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-            /*
-             *  Check for chunked encoding is added as the URL for chunked encoding used in this example returns binary data.
-             *  However, event handler can also be used in case chunked encoding is used.
-             */
-            if (!esp_http_client_is_chunked_response(evt->client)) {
-                // If user_data buffer is configured, copy the response into the buffer
-                if (evt->user_data) {
-                    memcpy(evt->user_data + output_len, evt->data, evt->data_len);
-                    output_len += evt->data_len;
-                }
-                
+            // chunked bodies arrive here already de-chunked, so both kinds are handled the same way
+            if (sink->overflow || sink->len + evt->data_len >= sink->cap) {
+                sink->overflow = true;
+                break;
             }
-
+            memcpy(sink->buf + sink->len, evt->data, evt->data_len);
+            sink->len += evt->data_len;
+            sink->buf[sink->len] = 0;
             break;
         case HTTP_EVENT_ON_FINISH:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-            if (evt->user_data) {
-                // make sure to null terminate the user_data buffer
-                ((char *) evt->user_data)[output_len] = 0;
-            }
-            output_len = 0;
             break;
         case HTTP_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
@@ -124,7 +117,15 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
-static void sling_http_get(esp_http_client_handle_t client, char *secret, char *endpoint) {
+/**
+ * GETs an endpoint into buf, retrying every HTTP_RETRY_MS until it succeeds
+ *
+ * with attempts other than 0, it backs off instead, and gives up after that many tries.
+ * the client keeps its connection open between calls, so only the first GET pays for the TLS
+ * handshake, as long as the server keeps the connection alive. returns 0 if successful
+ */
+static int sling_http_get(esp_http_client_handle_t client, struct http_sink *sink, char *secret, char *endpoint,
+                          char *buf, size_t cap, int attempts) {
     // /v1/devices/{secret}/{endpoint}
     // 13 + 36 (secret) + strlen(endpoint) + 1 (null)
     size_t path_len = 13 + 36 + strlen(endpoint) + 1;
@@ -134,34 +135,70 @@ static void sling_http_get(esp_http_client_handle_t client, char *secret, char *
     esp_http_client_set_url(client, path);
     free(path);
 
+    sink->buf = buf;
+    sink->cap = cap;
+
+    int64_t start = esp_timer_get_time();
+    uint32_t retry_ms = HTTP_RETRY_MS;
     esp_err_t err;
     uint16_t status;
-    while (1) {
+    for (int attempt = 1; ; attempt++) {
+        sink->len = 0;
+        sink->overflow = false;
+        buf[0] = 0;
+
         err = esp_http_client_perform(client);
         if (err == ESP_OK) {
             status = esp_http_client_get_status_code(client);
             if (status != HttpStatus_Ok) {
-                ESP_LOGE(TAG, "Unexpected HTTP response code %d in HTTP GET %s, retrying in 5s...", status, endpoint);
+                ESP_LOGE(TAG, "Unexpected HTTP response code %d in HTTP GET %s", status, endpoint);
+            } else if (sink->overflow) {
+                ESP_LOGE(TAG, "Response to HTTP GET %s is longer than %d bytes", endpoint, cap - 1);
             } else {
                 break;
             }
         } else {
-            ESP_LOGE(TAG, "ESP error %s in HTTP GET %s, retrying in 5s...", esp_err_to_name(err), endpoint);
+            ESP_LOGE(TAG, "ESP error %s in HTTP GET %s", esp_err_to_name(err), endpoint);
+        }
+
+        if (attempts != 0 && attempt >= attempts) {
+            ESP_LOGE(TAG, "Giving up on HTTP GET %s after %d tries", endpoint, attempt);
+            return 1;
+        }
+        ESP_LOGI(TAG, "Retrying HTTP GET %s in %u ms...", endpoint, retry_ms);
+        vTaskDelay(pdMS_TO_TICKS(retry_ms));
+        if (attempts != 0) {
+            retry_ms *= 2;
         }
-        vTaskDelay(5000 / portTICK_PERIOD_MS);
     }
+
+    ESP_LOGI(TAG, "HTTP GET %s: %d bytes in %lld ms", endpoint, sink->len, (esp_timer_get_time() - start) / 1000);
+    return 0;
 }
 
-struct sling_config *sling_init() {
-    char local_response_buffer[MAX_HTTP_OUTPUT_BUFFER] = {0};
+// just long enough to be converted to DER and stored
+struct pem_creds {
+    char cert[2048];
+    char key[2048];
+};
 
-    char secret[37] = {0};
-    sling_get_secret(secret);
-    if (secret == NULL) {
-        ESP_LOGE(TAG, "Couldn't get Sling secret. Giving up and rebooting.");
-        esp_restart();
-    } else {
-        ESP_LOGI(TAG, "Sling secret: %s", secret);
+/**
+ * fetches broker details for this device into conf, and stores its credentials
+ *
+ * attempts is how many tries each GET gets, as for sling_http_get(). release is passed on to
+ * sling_creds_store(). creds_changed is set if the stored credentials were replaced.
+ * returns 0 if successful
+ */
+static int fetch_config(struct sling_config *conf, char *secret, int attempts, void (*release)(void),
+                        bool *creds_changed) {
+    struct http_sink sink = {0};
+    // just the host; the rest of the broker URI is added after
+    char endpoint[sizeof(conf->broker_uri)];
+
+    struct pem_creds *pem = malloc(sizeof(struct pem_creds));
+    if (pem == NULL) {
+        ESP_LOGE(TAG, "Out of memory, can't provision");
+        return 1;
     }
 
     esp_http_client_config_t config = {
@@ -170,37 +207,225 @@ struct sling_config *sling_init() {
         .transport_type = HTTP_TRANSPORT_OVER_SSL,
         .cert_pem = (const char *) verisign_pca3_g5_crt_start, // TODO change this too, if using prod
         .event_handler = _http_event_handler,
-        .user_data = local_response_buffer,        // Pass address of local buffer to get response
+        .user_data = &sink,
         .disable_auto_redirect = false, // TODO temp, was true
     };
 
     esp_http_client_handle_t client = esp_http_client_init(&config);
 
-    struct sling_config *sling_conf = malloc(sizeof(struct sling_config));
-    sling_conf->server_cert_ptr = (const char *) sfs_root_g2_crt_start;
+    conf->server_cert_ptr = (const char *) sfs_root_g2_crt_start;
     
-    sling_http_get(client, secret, "mqtt_endpoint");
+    if (sling_http_get(client, &sink, secret, "mqtt_endpoint", endpoint, sizeof(endpoint), attempts) != 0
+        || sling_http_get(client, &sink, secret, "client_id", conf->client_id, sizeof(conf->client_id), attempts) != 0
+        || sling_http_get(client, &sink, secret, "cert", pem->cert, sizeof(pem->cert), attempts) != 0
+        || sling_http_get(client, &sink, secret, "key", pem->key, sizeof(pem->key), attempts) != 0) {
+        esp_http_client_cleanup(client);
+        memset(pem, 0, sizeof(*pem));
+        free(pem);
+        return 1;
+    }
+    esp_http_client_cleanup(client);
+
     // shh, it's all good now
     // silence the trunc warning since we don't really care if it gets truncated... i think...
     #if __GNUC__ >= 8
     #pragma GCC diagnostic push
     #pragma GCC diagnostic ignored "-Wformat-truncation"
     #endif
-    snprintf(sling_conf->broker_uri, sizeof(sling_conf->broker_uri), "mqtts://%s:8883", local_response_buffer);
+    snprintf(conf->broker_uri, sizeof(conf->broker_uri), "mqtts://%s:8883", endpoint);
     #if __GNUC__ >= 8
     #pragma GCC diagnostic pop
     #endif
 
-    sling_http_get(client, secret, "client_id");
-    strlcpy(sling_conf->client_id, local_response_buffer, sizeof(sling_conf->client_id));
+    int ret = sling_creds_store(pem->cert, pem->key, release, creds_changed);
+    memset(pem, 0, sizeof(*pem));
+    free(pem);
+    return ret;
+}
 
-    sling_http_get(client, secret, "cert");
-    strlcpy(sling_conf->client_cert, local_response_buffer, sizeof(sling_conf->client_cert));
+/**
+ * the last provisioned config, so we can go straight to the broker after a reboot
+ *
+ * the secret is stored along with it: if NVS got wiped, the cached config belongs to some other
+ * device identity and has to go.
+ */
+struct __attribute__((packed)) config_cache {
+    uint32_t magic;
+    uint32_t crc; // over everything after this field
+    char secret[37];
+    char broker_uri[96];
+    char client_id[16];
+};
 
-    sling_http_get(client, secret, "key");
-    strlcpy(sling_conf->client_key, local_response_buffer, sizeof(sling_conf->client_key));
+static bool load_cached_config(struct sling_config *conf, const char *secret) {
+    struct config_cache *cache = malloc(sizeof(struct config_cache));
+    if (cache == NULL) {
+        return false;
+    }
 
-    esp_http_client_cleanup(client);
+    bool valid = false;
+    FILE *file = fopen(CONFIG_CACHE_PATH, "r");
+    if (file == NULL) {
+        ESP_LOGI(TAG, "No cached config, provisioning from scratch");
+    } else if (fread(cache, sizeof(*cache), 1, file) != 1 || cache->magic != CONFIG_CACHE_MAGIC) {
+        ESP_LOGW(TAG, "Ignoring truncated or outdated config cache");
+    } else if (esp_rom_crc32_le(0, (const uint8_t *) cache->secret, CONFIG_CACHE_CRC_SIZE) != cache->crc) {
+        ESP_LOGW(TAG, "Config cache is corrupt, ignoring it");
+    } else if (strncmp(cache->secret, secret, sizeof(cache->secret)) != 0) {
+        ESP_LOGW(TAG, "Config cache is for another secret, ignoring it");
+    } else {
+        // memcpy rather than strlcpy; the CRC already vouches for the contents
+        memcpy(conf->broker_uri, cache->broker_uri, sizeof(conf->broker_uri));
+        memcpy(conf->client_id, cache->client_id, sizeof(conf->client_id));
+        conf->server_cert_ptr = (const char *) sfs_root_g2_crt_start;
+        valid = true;
+    }
+
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(cache);
+    return valid;
+}
+
+static int save_cached_config(const struct sling_config *conf, const char *secret) {
+    struct config_cache *cache = calloc(1, sizeof(struct config_cache));
+    if (cache == NULL) {
+        return 1;
+    }
+
+    cache->magic = CONFIG_CACHE_MAGIC;
+    strlcpy(cache->secret, secret, sizeof(cache->secret));
+    memcpy(cache->broker_uri, conf->broker_uri, sizeof(cache->broker_uri));
+    memcpy(cache->client_id, conf->client_id, sizeof(cache->client_id));
+    cache->crc = esp_rom_crc32_le(0, (const uint8_t *) cache->secret, CONFIG_CACHE_CRC_SIZE);
+
+    // a torn write just fails the CRC next boot, and we provision from scratch
+    int ret = 0;
+    FILE *file = fopen(CONFIG_CACHE_PATH, "w");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Couldn't open %s for writing", CONFIG_CACHE_PATH);
+        ret = 1;
+    } else {
+        if (fwrite(cache, sizeof(*cache), 1, file) != 1) {
+            ESP_LOGE(TAG, "Error writing %s", CONFIG_CACHE_PATH);
+            ret = 1;
+        }
+        fclose(file);
+    }
+
+    free(cache);
+    return ret;
+}
+
+static bool same_config(const struct sling_config *a, const struct sling_config *b) {
+    return strncmp(a->broker_uri, b->broker_uri, sizeof(a->broker_uri)) == 0
+        && strncmp(a->client_id, b->client_id, sizeof(a->client_id)) == 0;
+}
+
+struct revalidate_params {
+    // the config MQTT was started with
+    const struct sling_config *cached;
+    char secret[37];
+};
+
+static bool mqtt_released = false;
+
+// the MQTT client may be in a handshake with the old credentials
+static void release_mqtt(void) {
+    mqtt_released = true;
+    sling_mqtt_stop();
+}
+
+// provisions again behind the running client, and restarts if the backend has moved us elsewhere
+static void revalidate_task(void *pvParams) {
+    struct revalidate_params *params = pvParams;
+    struct sling_config *fresh = malloc(sizeof(struct sling_config));
+
+    if (fresh == NULL) {
+        ESP_LOGE(TAG, "Out of memory, can't check the cached config");
+    } else {
+        int64_t start = esp_timer_get_time();
+        bool creds_changed;
+        int ret = fetch_config(fresh, params->secret, REVALIDATE_ATTEMPTS, release_mqtt, &creds_changed);
+        ESP_LOGI(TAG, "Re-provisioned in %lld ms", (esp_timer_get_time() - start) / 1000);
+
+        if (ret != 0 && mqtt_released) {
+            // the client's gone, and the stored credentials may be half-written
+            ESP_LOGE(TAG, "Couldn't store the new credentials, restarting to provision from scratch");
+            esp_restart();
+        } else if (ret != 0) {
+            ESP_LOGE(TAG, "Couldn't check the cached config, sticking with it until the next boot");
+        } else if (!creds_changed && same_config(fresh, params->cached)) {
+            ESP_LOGI(TAG, "Cached config is up to date");
+        } else {
+            ESP_LOGW(TAG, "Provisioned config changed, saving it and restarting");
+            save_cached_config(fresh, params->secret);
+            esp_restart();
+        }
+        free(fresh);
+    }
+
+    free(params);
+    vTaskDelete(NULL);
+}
+
+static void start_revalidation(const struct sling_config *cached, const char *secret) {
+    struct revalidate_params *params = malloc(sizeof(struct revalidate_params));
+    if (params == NULL) {
+        ESP_LOGE(TAG, "Out of memory, can't check the cached config");
+        return;
+    }
+    params->cached = cached;
+    strlcpy(params->secret, secret, sizeof(params->secret));
+
+    // low priority, so it stays out of the way of the MQTT client starting up
+    BaseType_t result = xTaskCreatePinnedToCore(revalidate_task,
+        "revalidate_task",
+        5760, // same as sling_task, which used to do this
+        params,
+        1,
+        NULL,
+        0);
+
+    if (result != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start revalidate_task with result %d. Out of heap space?", result);
+        free(params);
+    }
+}
+
+struct sling_config *sling_init() {
+    char secret[37] = {0};
+    sling_get_secret(secret);
+    if (secret == NULL) {
+        ESP_LOGE(TAG, "Couldn't get Sling secret. Giving up and rebooting.");
+        esp_restart();
+    } else {
+        ESP_LOGI(TAG, "Sling secret: %s", secret);
+    }
+
+    struct sling_config *sling_conf = malloc(sizeof(struct sling_config));
+    const uint8_t *cert, *key;
+    size_t cert_len, key_len;
+
+    if (sling_creds_init() != 0) {
+        ESP_LOGE(TAG, "Nowhere to keep the client credentials. Giving up and rebooting.");
+        esp_restart();
+    }
+
+    if (sling_creds_get(&cert, &cert_len, &key, &key_len) && load_cached_config(sling_conf, secret)) {
+        ESP_LOGI(TAG, "Using cached config");
+        start_revalidation(sling_conf, secret);
+    } else {
+        int64_t start = esp_timer_get_time();
+        bool creds_changed;
+        if (fetch_config(sling_conf, secret, 0, NULL, &creds_changed) != 0) {
+            ESP_LOGE(TAG, "Couldn't store the client credentials. Giving up and rebooting.");
+            esp_restart();
+        }
+        ESP_LOGI(TAG, "Provisioned in %lld ms", (esp_timer_get_time() - start) / 1000);
+        save_cached_config(sling_conf, secret);
+    }
 
     ESP_LOGI(TAG, "Broker URI: %s", sling_conf->broker_uri);
     ESP_LOGI(TAG, "Client ID: %s", sling_conf->client_id);
@@ -1,5 +1,4 @@
 #include <stddef.h>
-#include <stdlib.h>
 #include <string.h>
 
 #include <sinter.h>
@@ -7,16 +6,15 @@
 #include "sling_message.h"
 #include "sling_sinter.h"
 
-struct sling_message_display *sling_sinter_value_to_message(sinter_value_t *value, size_t *message_size) {
-  // TODO handle array
+size_t sling_sinter_value_message_size(const sinter_value_t *value) {
   const size_t extra_size = value->type == sinter_type_string ? strlen(value->string_value) + 1 : 0;
-  const size_t message_len = sizeof(struct sling_message_display) + extra_size;
-  struct sling_message_display *payload = malloc(message_len);
-  if (!payload) {
-    return payload;
-  }
+  return sizeof(struct sling_message_display) + extra_size;
+}
 
+void sling_sinter_value_to_message(const sinter_value_t *value, struct sling_message_display *payload) {
+  // TODO handle array
   payload->data_type = value->type;
+  payload->string_length = 0;
 
   switch (value->type) {
   case sinter_type_boolean:
@@ -29,8 +27,9 @@ struct sling_message_display *sling_sinter_value_to_message(sinter_value_t *valu
     payload->float32 = value->float_value;
     break;
   case sinter_type_string: {
-    payload->string_length = extra_size - 1;
-    memcpy(&payload->string, value->string_value, extra_size);
+    const size_t len = strlen(value->string_value);
+    payload->string_length = len;
+    memcpy(&payload->string, value->string_value, len + 1);
     break;
   }
   case sinter_type_array:
@@ -42,10 +41,4 @@ struct sling_message_display *sling_sinter_value_to_message(sinter_value_t *valu
   default:
     break;
   }
-
-  if (message_size) {
-    *message_size = message_len;
-  }
-
-  return payload;
 }
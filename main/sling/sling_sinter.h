@@ -5,6 +5,10 @@
 
 #include "sling_message.h"
 
-struct sling_message_display *sling_sinter_value_to_message(sinter_value_t *value, size_t *message_size);
+// size of the display message for value, including the trailing string, if any
+size_t sling_sinter_value_message_size(const sinter_value_t *value);
+
+// serializes value into payload, which must be at least sling_sinter_value_message_size(value) bytes
+void sling_sinter_value_to_message(const sinter_value_t *value, struct sling_message_display *payload);
 
 #endif
@@ -0,0 +1,118 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "sling_window.h"
+
+static const char *TAG = "sling_window";
+
+#define WINDOW_ENTRIES 32
+
+struct window_entry {
+    uint32_t first;
+    uint32_t last;
+    size_t offset;
+    size_t len;
+};
+
+// messages are laid out one after the other in buf, starting over at 0 when they don't fit at the end
+struct sling_window {
+    char *buf;
+    size_t size;
+
+    // circular, in the order they were added
+    struct window_entry entries[WINDOW_ENTRIES];
+    size_t oldest;
+    size_t count;
+
+    SemaphoreHandle_t lock;
+};
+
+struct sling_window *sling_window_create(size_t size) {
+    struct sling_window *window = calloc(1, sizeof(*window));
+    if (window == NULL) {
+        return NULL;
+    }
+
+    window->buf = malloc(size);
+    window->lock = xSemaphoreCreateMutex();
+    if (window->buf == NULL || window->lock == NULL) {
+        ESP_LOGE(TAG, "Error allocating %d byte window", size);
+        free(window->buf);
+        if (window->lock) vSemaphoreDelete(window->lock);
+        free(window);
+        return NULL;
+    }
+
+    window->size = size;
+    return window;
+}
+
+static inline struct window_entry *entry_at(struct sling_window *window, size_t i) {
+    return &window->entries[(window->oldest + i) % WINDOW_ENTRIES];
+}
+
+static bool overlaps_any(struct sling_window *window, size_t offset, size_t len) {
+    for (size_t i = 0; i < window->count; i++) {
+        struct window_entry *entry = entry_at(window, i);
+        if (entry->offset < offset + len && offset < entry->offset + entry->len) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void sling_window_add(struct sling_window *window, uint32_t first, uint32_t last, const char *payload, size_t len) {
+    if (len > window->size) {
+        return;
+    }
+
+    xSemaphoreTake(window->lock, portMAX_DELAY);
+
+    size_t offset = 0;
+    if (window->count > 0) {
+        struct window_entry *newest = entry_at(window, window->count - 1);
+        offset = newest->offset + newest->len;
+        if (offset + len > window->size) {
+            offset = 0;
+        }
+    }
+
+    // the space right after the newest message always belongs to the oldest ones
+    while (window->count == WINDOW_ENTRIES || overlaps_any(window, offset, len)) {
+        window->oldest = (window->oldest + 1) % WINDOW_ENTRIES;
+        window->count--;
+    }
+
+    memcpy(window->buf + offset, payload, len);
+    *entry_at(window, window->count) = (struct window_entry) {
+        .first = first,
+        .last = last,
+        .offset = offset,
+        .len = len,
+    };
+    window->count++;
+
+    xSemaphoreGive(window->lock);
+}
+
+size_t sling_window_resend(struct sling_window *window, uint32_t first, uint32_t last,
+        void (*resend)(void *ctx, char *payload, size_t len), void *ctx) {
+    xSemaphoreTake(window->lock, portMAX_DELAY);
+
+    size_t resent = 0;
+    for (size_t i = 0; i < window->count; i++) {
+        struct window_entry *entry = entry_at(window, i);
+        if (entry->first <= last && first <= entry->last) {
+            resend(ctx, window->buf + entry->offset, entry->len);
+            resent++;
+        }
+    }
+
+    xSemaphoreGive(window->lock);
+    return resent;
+}
@@ -0,0 +1,27 @@
+#ifndef SLING_WINDOW_H
+#define SLING_WINDOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * bounded history of display messages sent at QoS 0, so the backend can ask for ones it missed
+ *
+ * each message covers a range of message counters (a batch covers several). adding a message
+ * evicts the oldest ones to make room. safe to use from several tasks.
+ */
+struct sling_window;
+
+struct sling_window *sling_window_create(size_t size);
+
+void sling_window_add(struct sling_window *window, uint32_t first, uint32_t last, const char *payload, size_t len);
+
+/**
+ * calls resend on every message in the window that covers any counter in [first, last], oldest first
+ *
+ * returns the number of messages resent.
+ */
+size_t sling_window_resend(struct sling_window *window, uint32_t first, uint32_t last,
+    void (*resend)(void *ctx, char *payload, size_t len), void *ctx);
+
+#endif
@@ -0,0 +1,286 @@
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <nvs_flash.h>
+
+#include "config_store.h"
+
+static const char *TAG = "config_store";
+
+#define WIFI_NAMESPACE "wifi"
+#define SLING_NAMESPACE "sling"
+
+static struct config current;
+// the batch between config_store_begin() and config_store_commit()
+static struct config staged;
+
+// held by readers only while copying current, so they never wait on NVS
+static SemaphoreHandle_t read_lock;
+// held from config_store_begin() until the batch is committed or dropped
+static SemaphoreHandle_t write_lock;
+
+static esp_err_t open_namespace(const char *namespace, nvs_open_mode_t mode, nvs_handle_t *handle) {
+    esp_err_t err = nvs_open(namespace, mode, handle);
+    // a namespace that was never written doesn't exist yet
+    if (err != ESP_OK && !(mode == NVS_READONLY && err == ESP_ERR_NVS_NOT_FOUND)) {
+        ESP_LOGE(TAG, "Got error %s while opening NVS namespace %s", esp_err_to_name(err), namespace);
+    }
+    return err;
+}
+
+// a missing key reads as an empty string
+static esp_err_t get_str(nvs_handle_t handle, const char *key, char *out, size_t size) {
+    esp_err_t err = nvs_get_str(handle, key, out, &size);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        out[0] = '\0';
+        return ESP_OK;
+    }
+    return err;
+}
+
+static void load_wifi(struct config_wifi *wifi) {
+    memset(wifi, 0, sizeof(*wifi));
+
+    nvs_handle_t handle;
+    if (open_namespace(WIFI_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+
+    uint8_t version = 0;
+    esp_err_t err = nvs_get_u8(handle, "conf_version", &version);
+    if (err == ESP_OK && version == 1) {
+        uint8_t authmode;
+        uint8_t validate_ca = 0;
+        size_t ssid_len = sizeof(wifi->ssid);
+
+        err = nvs_get_u8(handle, "sta_authmode", &authmode);
+        if (err == ESP_OK) {
+            err = nvs_get_str(handle, "sta_ssid", wifi->ssid, &ssid_len);
+        }
+        // the rest depends on the authmode
+        if (err == ESP_OK) {
+            err = get_str(handle, "sta_password", wifi->password, sizeof(wifi->password));
+        }
+        if (err == ESP_OK) {
+            err = get_str(handle, "sta_identity", wifi->identity, sizeof(wifi->identity));
+        }
+        if (err == ESP_OK && (err = nvs_get_u8(handle, "sta_validate_ca", &validate_ca)) == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+
+        if (err == ESP_OK) {
+            wifi->configured = true;
+            wifi->authmode = authmode;
+            wifi->validate_cacert = validate_ca == 1;
+        } else {
+            ESP_LOGE(TAG, "Error %s loading STA config, ignoring it", esp_err_to_name(err));
+            memset(wifi, 0, sizeof(*wifi));
+        }
+    } else if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(TAG, "STA config not found, or invalid config (wrong version?)");
+    } else {
+        ESP_LOGE(TAG, "Error getting conf_version: %s", esp_err_to_name(err));
+    }
+
+    size_t hint_len = sizeof(wifi->hint);
+    if (nvs_get_blob(handle, "sta_hint", &wifi->hint, &hint_len) == ESP_OK && hint_len == sizeof(wifi->hint)) {
+        wifi->has_hint = true;
+    } else {
+        memset(&wifi->hint, 0, sizeof(wifi->hint));
+    }
+
+    if (nvs_get_u32(handle, "sta_ip", &wifi->ip) == ESP_OK) {
+        if (nvs_get_u32(handle, "sta_netmask", &wifi->netmask) != ESP_OK
+            || nvs_get_u32(handle, "sta_gw", &wifi->gw) != ESP_OK) {
+            ESP_LOGE(TAG, "Static IP is missing its netmask or gateway, using DHCP");
+            wifi->ip = wifi->netmask = wifi->gw = 0;
+        } else if (nvs_get_u32(handle, "sta_dns", &wifi->dns) != ESP_OK) {
+            wifi->dns = 0;
+        }
+    }
+
+    nvs_close(handle);
+}
+
+static void load_sling(struct config_sling *sling) {
+    memset(sling, 0, sizeof(*sling));
+
+    nvs_handle_t handle;
+    if (open_namespace(SLING_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+
+    esp_err_t err = get_str(handle, "secret", sling->secret, sizeof(sling->secret));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Got error %s while retrieving Sling secret from NVS", esp_err_to_name(err));
+        sling->secret[0] = '\0';
+    }
+
+    nvs_close(handle);
+}
+
+esp_err_t config_store_init(void) {
+    read_lock = xSemaphoreCreateMutex();
+    write_lock = xSemaphoreCreateMutex();
+    if (read_lock == NULL || write_lock == NULL) {
+        ESP_LOGE(TAG, "Failed to create config store locks");
+        return ESP_ERR_NO_MEM;
+    }
+
+    load_wifi(&current.wifi);
+    load_sling(&current.sling);
+    return ESP_OK;
+}
+
+void config_store_get(struct config *config) {
+    xSemaphoreTake(read_lock, portMAX_DELAY);
+    *config = current;
+    xSemaphoreGive(read_lock);
+}
+
+struct config *config_store_begin(void) {
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    // only writers change current, and we're the only one
+    staged = current;
+    return &staged;
+}
+
+void config_store_abort(void) {
+    xSemaphoreGive(write_lock);
+}
+
+static esp_err_t erase_key(nvs_handle_t handle, const char *key) {
+    esp_err_t err = nvs_erase_key(handle, key);
+    return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+}
+
+// an empty string erases the key. old is NULL if we don't know what's stored
+static esp_err_t put_str(nvs_handle_t handle, const char *key, const char *old, const char *new) {
+    if (old != NULL && strcmp(old, new) == 0) {
+        return ESP_OK;
+    }
+    return new[0] == '\0' ? erase_key(handle, key) : nvs_set_str(handle, key, new);
+}
+
+// 0 erases the key
+static esp_err_t put_u32(nvs_handle_t handle, const char *key, uint32_t old, uint32_t new) {
+    if (old == new) {
+        return ESP_OK;
+    }
+    return new == 0 ? erase_key(handle, key) : nvs_set_u32(handle, key, new);
+}
+
+static esp_err_t write_wifi(nvs_handle_t handle) {
+    const struct config_wifi *old = &current.wifi;
+    const struct config_wifi *new = &staged.wifi;
+    esp_err_t err = ESP_OK;
+
+    // without a loaded STA config, the old keys in RAM are zeroes rather than what's stored
+    bool fresh = new->configured && !old->configured;
+    bool sta_changed = old->configured != new->configured
+                       || strcmp(old->ssid, new->ssid) != 0 || old->authmode != new->authmode
+                       || old->validate_cacert != new->validate_cacert
+                       || strcmp(old->identity, new->identity) != 0 || strcmp(old->password, new->password) != 0;
+
+    // conf_version is erased before any STA key changes and set after the last one, so a
+    // half-written STA config is ignored rather than loaded as a mix of old and new
+    if (sta_changed) {
+        err = erase_key(handle, "conf_version");
+    }
+    if (err == ESP_OK && (fresh || strcmp(old->ssid, new->ssid) != 0)) {
+        err = nvs_set_str(handle, "sta_ssid", new->ssid);
+    }
+    if (err == ESP_OK && (fresh || old->authmode != new->authmode)) {
+        err = nvs_set_u8(handle, "sta_authmode", new->authmode);
+    }
+    if (err == ESP_OK && (fresh || old->validate_cacert != new->validate_cacert)) {
+        err = nvs_set_u8(handle, "sta_validate_ca", new->validate_cacert ? 1 : 0);
+    }
+    if (err == ESP_OK) {
+        err = put_str(handle, "sta_identity", fresh ? NULL : old->identity, new->identity);
+    }
+    if (err == ESP_OK) {
+        err = put_str(handle, "sta_password", fresh ? NULL : old->password, new->password);
+    }
+    if (err == ESP_OK && sta_changed && new->configured) {
+        err = nvs_set_u8(handle, "conf_version", 1);
+    }
+
+    if (err == ESP_OK && (old->has_hint != new->has_hint
+                          || (new->has_hint && memcmp(&old->hint, &new->hint, sizeof(new->hint)) != 0))) {
+        err = new->has_hint ? nvs_set_blob(handle, "sta_hint", &new->hint, sizeof(new->hint))
+                            : erase_key(handle, "sta_hint");
+    }
+
+    // likewise sta_ip, so a half-written static IP falls back to DHCP
+    bool static_ip_changed = old->ip != new->ip || old->netmask != new->netmask
+                             || old->gw != new->gw || old->dns != new->dns;
+    if (err == ESP_OK && static_ip_changed) {
+        err = erase_key(handle, "sta_ip");
+    }
+    if (err == ESP_OK) {
+        err = put_u32(handle, "sta_netmask", old->netmask, new->netmask);
+    }
+    if (err == ESP_OK) {
+        err = put_u32(handle, "sta_gw", old->gw, new->gw);
+    }
+    if (err == ESP_OK) {
+        err = put_u32(handle, "sta_dns", old->dns, new->dns);
+    }
+    if (err == ESP_OK && static_ip_changed && new->ip != 0) {
+        err = nvs_set_u32(handle, "sta_ip", new->ip);
+    }
+
+    return err;
+}
+
+static esp_err_t write_sling(nvs_handle_t handle) {
+    return put_str(handle, "secret", current.sling.secret, staged.sling.secret);
+}
+
+static esp_err_t write_namespace(const char *namespace, esp_err_t (*write)(nvs_handle_t handle)) {
+    nvs_handle_t handle;
+    esp_err_t err = open_namespace(namespace, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = write(handle);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error %s writing NVS namespace %s", esp_err_to_name(err), namespace);
+    }
+
+    nvs_close(handle);
+    return err;
+}
+
+int config_store_commit(void) {
+    bool wifi_changed = memcmp(&current.wifi, &staged.wifi, sizeof(staged.wifi)) != 0;
+    bool sling_changed = memcmp(&current.sling, &staged.sling, sizeof(staged.sling)) != 0;
+    int ret = 0;
+
+    // some of the keys may have made it before the failure; go with what's actually there
+    if (wifi_changed && write_namespace(WIFI_NAMESPACE, write_wifi) != ESP_OK) {
+        load_wifi(&staged.wifi);
+        ret = 1;
+    }
+    if (sling_changed && write_namespace(SLING_NAMESPACE, write_sling) != ESP_OK) {
+        load_sling(&staged.sling);
+        ret = 1;
+    }
+
+    if (wifi_changed || sling_changed) {
+        staged.version = current.version + 1;
+        xSemaphoreTake(read_lock, portMAX_DELAY);
+        current = staged;
+        xSemaphoreGive(read_lock);
+    }
+
+    xSemaphoreGive(write_lock);
+    return ret;
+}
@@ -0,0 +1,74 @@
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "../wifi/wifi_connect.h"
+
+// the wifi namespace; see wifi_config.c for what each key holds
+struct config_wifi {
+    // conf_version is 1, so the STA settings are there
+    bool configured;
+    char ssid[33];
+    uint8_t authmode;
+    bool validate_cacert;
+    char identity[64];
+    char password[64];
+
+    bool has_hint;
+    struct wifi_hint hint;
+
+    // 0 for DHCP
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gw;
+    // 0 to use the gateway
+    uint32_t dns;
+};
+
+// the sling namespace
+struct config_sling {
+    // empty until one's generated
+    char secret[37];
+};
+
+struct config {
+    // bumped by every commit that changed something
+    uint32_t version;
+    struct config_wifi wifi;
+    struct config_sling sling;
+};
+
+/**
+ * everything we keep in NVS, loaded into RAM once at boot
+ *
+ * reads are served from RAM and never touch NVS. call once, after nvs_flash_init()
+ */
+esp_err_t config_store_init(void);
+
+// copies out the current config
+void config_store_get(struct config *config);
+
+/**
+ * starts a batch of writes
+ *
+ * returns a copy of the current config to change in place. other writers wait until
+ * config_store_commit() or config_store_abort(); readers don't.
+ */
+struct config *config_store_begin(void);
+
+/**
+ * writes the keys that changed in the batch, with one nvs_commit() per namespace
+ *
+ * if a write fails, the namespace is reloaded from NVS, so what's in RAM is what's stored.
+ * returns 0 if successful
+ */
+int config_store_commit(void);
+
+// drops the batch
+void config_store_abort(void);
+
+#endif
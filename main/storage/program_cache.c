@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/unistd.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <mbedtls/sha256.h>
+
+#include "program_cache.h"
+
+static const char *TAG = "program_cache";
+
+#define CACHE_DIR "/storage"
+#define CACHE_INDEX_PATH CACHE_DIR "/index"
+
+// the 64K partition is about 52K usable, some of which spiffs needs free for garbage collection.
+// this, the spool's SPOOL_MAX_SIZE and the index have to fit in it together
+#define CACHE_MAX_ENTRIES 16
+#define CACHE_BUDGET 0x4000
+
+#define CACHE_INDEX_MAGIC 0x31494350 // "PCI1"
+
+// entries are files named after the first bytes of their hash, to fit spiffs' 32 char names
+#define CACHE_NAME_HASH_BYTES 12
+
+struct cache_entry {
+    uint8_t hash[PROGRAM_CACHE_HASH_SIZE];
+    uint32_t size;
+    uint32_t last_used;
+};
+
+struct cache_index {
+    uint32_t magic;
+    uint32_t count;
+    // bumped on every use, for LRU
+    uint32_t clock;
+    struct cache_entry entries[CACHE_MAX_ENTRIES];
+};
+
+static struct cache_index cache_index;
+// only the LRU clocks changed since the index was last saved; they're saved lazily, since a hit
+// shouldn't cost a flash write
+static bool clocks_dirty = false;
+static bool cache_available = false;
+static SemaphoreHandle_t cache_lock;
+
+static uint32_t cache_hits = 0;
+static uint32_t cache_misses = 0;
+
+static void entry_path(const uint8_t hash[PROGRAM_CACHE_HASH_SIZE], char path[static 40]) {
+    int len = sprintf(path, CACHE_DIR "/p");
+    for (int i = 0; i < CACHE_NAME_HASH_BYTES; i++) {
+        len += sprintf(path + len, "%02x", hash[i]);
+    }
+}
+
+static struct cache_entry *find_entry(const uint8_t hash[PROGRAM_CACHE_HASH_SIZE]) {
+    for (int i = 0; i < cache_index.count; i++) {
+        if (memcmp(cache_index.entries[i].hash, hash, PROGRAM_CACHE_HASH_SIZE) == 0) {
+            return &cache_index.entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void save_index() {
+    FILE *file = fopen(CACHE_INDEX_PATH, "w");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Couldn't open %s for writing", CACHE_INDEX_PATH);
+        return;
+    }
+
+    size_t len = offsetof(struct cache_index, entries) + cache_index.count * sizeof(struct cache_entry);
+    if (fwrite(&cache_index, len, 1, file) != 1) {
+        ESP_LOGE(TAG, "Error writing %s", CACHE_INDEX_PATH);
+    } else {
+        clocks_dirty = false;
+    }
+    fclose(file);
+}
+
+static void remove_entry(struct cache_entry *entry) {
+    char path[40];
+    entry_path(entry->hash, path);
+    unlink(path);
+
+    // order doesn't matter, so just move the last entry into the hole
+    *entry = cache_index.entries[--cache_index.count];
+}
+
+static size_t used_space() {
+    size_t used = 0;
+    for (int i = 0; i < cache_index.count; i++) {
+        used += cache_index.entries[i].size;
+    }
+    return used;
+}
+
+// drops entries the index doesn't know about, e.g. from a put that was interrupted by a reset
+static void remove_orphans() {
+    DIR *dir = opendir(CACHE_DIR);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] != 'p') {
+            continue;
+        }
+
+        bool known = false;
+        char path[40];
+        for (int i = 0; i < cache_index.count && !known; i++) {
+            entry_path(cache_index.entries[i].hash, path);
+            known = strcmp(path + strlen(CACHE_DIR) + 1, ent->d_name) == 0;
+        }
+
+        if (!known) {
+            snprintf(path, sizeof(path), CACHE_DIR "/%.32s", ent->d_name);
+            ESP_LOGW(TAG, "Removing orphaned cache entry %s", path);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+int program_cache_init(void) {
+    cache_lock = xSemaphoreCreateMutex();
+    if (cache_lock == NULL) {
+        return 1;
+    }
+
+    DIR *dir = opendir(CACHE_DIR);
+    if (dir == NULL) {
+        ESP_LOGW(TAG, "%s not mounted, program cache disabled", CACHE_DIR);
+        return 1;
+    }
+    closedir(dir);
+
+    memset(&cache_index, 0, sizeof(cache_index));
+    FILE *file = fopen(CACHE_INDEX_PATH, "r");
+    if (file != NULL) {
+        size_t len = fread(&cache_index, 1, sizeof(cache_index), file);
+        fclose(file);
+
+        size_t expected = offsetof(struct cache_index, entries) + cache_index.count * sizeof(struct cache_entry);
+        if (cache_index.magic != CACHE_INDEX_MAGIC || cache_index.count > CACHE_MAX_ENTRIES || len != expected) {
+            ESP_LOGW(TAG, "Invalid cache index, starting over");
+            memset(&cache_index, 0, sizeof(cache_index));
+        }
+    }
+    cache_index.magic = CACHE_INDEX_MAGIC;
+
+    remove_orphans();
+    cache_available = true;
+
+    ESP_LOGI(TAG, "Program cache has %d entries, %d bytes", cache_index.count, used_space());
+    return 0;
+}
+
+bool program_cache_lookup(const uint8_t hash[PROGRAM_CACHE_HASH_SIZE], size_t *size) {
+    if (!cache_available) {
+        cache_misses++;
+        return false;
+    }
+
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    struct cache_entry *entry = find_entry(hash);
+    if (entry != NULL) {
+        *size = entry->size;
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+    xSemaphoreGive(cache_lock);
+
+    return entry != NULL;
+}
+
+int program_cache_read(const uint8_t hash[PROGRAM_CACHE_HASH_SIZE], unsigned char *code, size_t size) {
+    if (!cache_available) {
+        return 1;
+    }
+
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    int ret = 1;
+    struct cache_entry *entry = find_entry(hash);
+    if (entry == NULL || entry->size != size) {
+        goto out;
+    }
+
+    char path[40];
+    entry_path(hash, path);
+    FILE *file = fopen(path, "r");
+    size_t len = 0;
+    if (file != NULL) {
+        len = fread(code, 1, size, file);
+        fclose(file);
+    }
+
+    uint8_t actual[PROGRAM_CACHE_HASH_SIZE];
+    mbedtls_sha256_ret(code, size, actual, 0);
+    if (len != size || memcmp(actual, hash, PROGRAM_CACHE_HASH_SIZE) != 0) {
+        ESP_LOGE(TAG, "Cache entry %s is corrupt, evicting it", path);
+        remove_entry(entry);
+        save_index();
+        goto out;
+    }
+
+    entry->last_used = ++cache_index.clock;
+    clocks_dirty = true;
+    ret = 0;
+
+out:
+    xSemaphoreGive(cache_lock);
+    return ret;
+}
+
+int program_cache_put(const uint8_t hash[PROGRAM_CACHE_HASH_SIZE], const unsigned char *code, size_t size) {
+    if (!cache_available) {
+        return 1;
+    }
+    if (size > CACHE_BUDGET) {
+        ESP_LOGI(TAG, "Program of %d bytes too big to cache", size);
+        return 1;
+    }
+
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    int ret = 0;
+    struct cache_entry *entry = find_entry(hash);
+    if (entry != NULL) {
+        entry->last_used = ++cache_index.clock;
+        clocks_dirty = true;
+        xSemaphoreGive(cache_lock);
+        return 0;
+    }
+
+    // evict least recently used entries until the new one fits
+    while (cache_index.count == CACHE_MAX_ENTRIES || used_space() + size > CACHE_BUDGET) {
+        struct cache_entry *lru = &cache_index.entries[0];
+        for (int i = 1; i < cache_index.count; i++) {
+            if (cache_index.entries[i].last_used < lru->last_used) {
+                lru = &cache_index.entries[i];
+            }
+        }
+        ESP_LOGI(TAG, "Evicting %d byte program", lru->size);
+        remove_entry(lru);
+    }
+
+    char path[40];
+    entry_path(hash, path);
+    FILE *file = fopen(path, "w");
+    if (file == NULL || fwrite(code, size, 1, file) != 1) {
+        ESP_LOGE(TAG, "Error writing %s", path);
+        if (file != NULL) {
+            fclose(file);
+            unlink(path);
+        }
+        ret = 1;
+        goto out;
+    }
+    fclose(file);
+
+    entry = &cache_index.entries[cache_index.count++];
+    memcpy(entry->hash, hash, PROGRAM_CACHE_HASH_SIZE);
+    entry->size = size;
+    entry->last_used = ++cache_index.clock;
+    ESP_LOGI(TAG, "Cached %d byte program", size);
+
+out:
+    save_index();
+    xSemaphoreGive(cache_lock);
+    return ret;
+}
+
+void program_cache_flush(void) {
+    if (!cache_available) {
+        return;
+    }
+
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    if (clocks_dirty) {
+        save_index();
+    }
+    xSemaphoreGive(cache_lock);
+}
+
+void program_cache_stats(uint32_t *hits, uint32_t *misses) {
+    *hits = cache_hits;
+    *misses = cache_misses;
+}
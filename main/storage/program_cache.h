@@ -0,0 +1,46 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256 of the program bytecode
+#define PROGRAM_CACHE_HASH_SIZE 32
+
+/**
+ * LRU cache of recently run programs in the storage spiffs partition, keyed by hash
+ *
+ * hits only update the LRU order in RAM; it's written out with the next change to the cache, or
+ * by program_cache_flush(). all functions are safe to call from any task.
+ */
+int program_cache_init(void);
+
+/**
+ * looks up a program and counts a hit or a miss
+ *
+ * returns true and the program size if it's cached
+ */
+bool program_cache_lookup(const uint8_t hash[PROGRAM_CACHE_HASH_SIZE], size_t *size);
+
+/**
+ * reads a cached program into code, which must be exactly the size from program_cache_lookup()
+ *
+ * the contents are checked against the hash; a corrupt entry is evicted.
+ * returns 0 if successful
+ */
+int program_cache_read(const uint8_t hash[PROGRAM_CACHE_HASH_SIZE], unsigned char *code, size_t size);
+
+/**
+ * stores a program, evicting least recently used ones to make space
+ *
+ * returns 0 if successful, or if it's already cached
+ */
+int program_cache_put(const uint8_t hash[PROGRAM_CACHE_HASH_SIZE], const unsigned char *code, size_t size);
+
+// saves the LRU order, if hits changed it since it was last saved
+void program_cache_flush(void);
+
+void program_cache_stats(uint32_t *hits, uint32_t *misses);
+
+#endif
@@ -10,17 +10,20 @@
 
 static const char *TAG = "spiffs";
 
-esp_err_t spiffs_init(void) {
-    ESP_LOGI(TAG, "Initializing certs spiffs partition");
+static esp_err_t mount_partition(const char *label, size_t max_files) {
+    ESP_LOGI(TAG, "Initializing %s spiffs partition", label);
+
+    char base_path[16];
+    snprintf(base_path, sizeof(base_path), "/%s", label);
 
-    esp_vfs_spiffs_conf_t certs_conf = {
-        .base_path = "/certs",
-        .partition_label = "certs",
-        .max_files = 5, // wifi CA, cadet CA, aws iot CA + wifi user cert/key?
+    esp_vfs_spiffs_conf_t conf = {
+        .base_path = base_path,
+        .partition_label = label,
+        .max_files = max_files,
         .format_if_mount_failed = true,
     };
 
-    esp_err_t err = esp_vfs_spiffs_register(&certs_conf);
+    esp_err_t err = esp_vfs_spiffs_register(&conf);
 
     if (err != ESP_OK) {
         if (err == ESP_FAIL) {
@@ -32,7 +35,7 @@ esp_err_t spiffs_init(void) {
         }
     } else {
         size_t total = 0, used = 0;
-        err = esp_spiffs_info(certs_conf.partition_label, &total, &used);
+        err = esp_spiffs_info(conf.partition_label, &total, &used);
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(err));
         } else {
@@ -43,6 +46,25 @@ esp_err_t spiffs_init(void) {
     return err;
 }
 
+esp_err_t spiffs_init(void) {
+    esp_err_t err = mount_partition("certs", 5); // wifi CA, cadet CA, aws iot CA + wifi user cert/key?
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // program cache and output spool; not fatal if it's missing
+    if (mount_partition("storage", 5) != ESP_OK) {
+        ESP_LOGW(TAG, "Continuing without the storage partition");
+    }
+
+    // cached sling config; without it we just provision on every boot
+    if (mount_partition("user_cfg", 2) != ESP_OK) {
+        ESP_LOGW(TAG, "Continuing without the user_cfg partition");
+    }
+
+    return ESP_OK;
+}
+
 int spiffs_write(char *partition, char *filename, char *data, size_t data_sz) {
     ESP_LOGI(TAG, "Writing %d bytes to /%s/%s", data_sz, partition, filename);
     struct stat st;
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/unistd.h>
+
+#include <esp_log.h>
+
+#include "spool.h"
+
+static const char *TAG = "spool";
+
+#define SPOOL_DIR "/storage"
+#define SPOOL_PATH SPOOL_DIR "/spool"
+
+// shares the 64K partition with the program cache; see CACHE_BUDGET
+#define SPOOL_MAX_SIZE 0x4000
+
+struct __attribute__((packed)) spool_hdr {
+    uint8_t kind;
+    uint16_t len;
+};
+
+static FILE *spool_file;
+static size_t spool_size = 0;
+static size_t spool_count = 0;
+static bool spool_available = false;
+
+int spool_init(void) {
+    DIR *dir = opendir(SPOOL_DIR);
+    if (dir == NULL) {
+        ESP_LOGW(TAG, "%s not mounted, output will wait in RAM while offline", SPOOL_DIR);
+        return 1;
+    }
+    closedir(dir);
+
+    // counters restart after a reboot, so anything left over is of no use to the backend
+    unlink(SPOOL_PATH);
+
+    spool_available = true;
+    return 0;
+}
+
+bool spool_append(uint8_t kind, const char *payload, size_t len) {
+    if (!spool_available || len > SPOOL_RECORD_MAX || spool_size + sizeof(struct spool_hdr) + len > SPOOL_MAX_SIZE) {
+        return false;
+    }
+
+    if (spool_file == NULL) {
+        spool_file = fopen(SPOOL_PATH, "w");
+        if (spool_file == NULL) {
+            ESP_LOGE(TAG, "Couldn't open %s for writing", SPOOL_PATH);
+            return false;
+        }
+        // unbuffered, so a failed write can't leave part of a record behind in a buffer
+        setvbuf(spool_file, NULL, _IONBF, 0);
+    }
+
+    struct spool_hdr hdr = { .kind = kind, .len = len };
+    if (fwrite(&hdr, sizeof(hdr), 1, spool_file) != 1 || fwrite(payload, len, 1, spool_file) != 1) {
+        ESP_LOGE(TAG, "Error writing %s, not spooling this message", SPOOL_PATH);
+        // e.g. out of space for now; the next record goes over the partial one, and replay stops
+        // after spool_count records, so it's never read back
+        clearerr(spool_file);
+        if (fseek(spool_file, spool_size, SEEK_SET) != 0) {
+            ESP_LOGE(TAG, "Couldn't rewind %s, dropping %d spooled messages", SPOOL_PATH, spool_count);
+            fclose(spool_file);
+            spool_file = NULL;
+            unlink(SPOOL_PATH);
+            spool_size = 0;
+            spool_count = 0;
+        }
+        return false;
+    }
+
+    spool_size += sizeof(hdr) + len;
+    spool_count++;
+    return true;
+}
+
+bool spool_empty(void) {
+    return spool_count == 0;
+}
+
+size_t spool_replay(void (*send)(void *ctx, uint8_t kind, char *payload, size_t len), void *ctx) {
+    if (spool_file == NULL) {
+        return 0;
+    }
+    fclose(spool_file);
+    spool_file = NULL;
+
+    size_t replayed = 0;
+    // only needed while replaying, so it isn't held on to while offline
+    char *buf = malloc(SPOOL_RECORD_MAX);
+    FILE *file = fopen(SPOOL_PATH, "r");
+    if (buf == NULL || file == NULL) {
+        ESP_LOGE(TAG, "Couldn't replay spool, dropping %d messages", spool_count);
+        goto out;
+    }
+
+    struct spool_hdr hdr;
+    while (replayed < spool_count && fread(&hdr, sizeof(hdr), 1, file) == 1) {
+        if (hdr.len > SPOOL_RECORD_MAX || fread(buf, hdr.len, 1, file) != 1) {
+            ESP_LOGE(TAG, "Spool is corrupt, dropping the rest");
+            break;
+        }
+        send(ctx, hdr.kind, buf, hdr.len);
+        replayed++;
+    }
+
+    ESP_LOGI(TAG, "Replayed %d of %d spooled messages (%d bytes)", replayed, spool_count, spool_size);
+
+out:
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(buf);
+    unlink(SPOOL_PATH);
+    spool_size = 0;
+    spool_count = 0;
+    return replayed;
+}
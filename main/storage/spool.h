@@ -0,0 +1,34 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// largest message the spool takes
+#define SPOOL_RECORD_MAX 0x1000
+
+/**
+ * bounded queue of outgoing messages in the storage spiffs partition, for while MQTT is down
+ *
+ * only meant to be used from one task.
+ */
+int spool_init(void);
+
+/**
+ * appends a message, tagged with kind so it can be sent to the right topic later
+ *
+ * returns false if the spool is full or unavailable.
+ */
+bool spool_append(uint8_t kind, const char *payload, size_t len);
+
+bool spool_empty(void);
+
+/**
+ * calls send for every spooled message, in order, then empties the spool
+ *
+ * returns the number of messages replayed.
+ */
+size_t spool_replay(void (*send)(void *ctx, uint8_t kind, char *payload, size_t len), void *ctx);
+
+#endif
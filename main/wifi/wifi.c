@@ -1,4 +1,5 @@
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "esp_log.h"
 #include "esp_wifi.h"
@@ -32,42 +33,53 @@ void wifi_task(void *pvParams) {
     io_conf.pin_bit_mask = (1ull << GPIO_NUM_37); // button A
     gpio_config(&io_conf);
 
-    if (gpio_get_level(GPIO_NUM_37) == 0) {
-        ESP_LOGW(TAG, "Button A pressed, entering AP mode for config");
-        wifi_ap_start(); // and don't ever come back here
-    } else if (wifi_load_config() != 0) { // failed to load config, what's up?
+    bool config_ap = gpio_get_level(GPIO_NUM_37) == 0;
+    if (wifi_load_config() != 0) { // failed to load config, what's up?
         ESP_LOGW(TAG, "Error loading WiFi config, entering AP mode");
-        wifi_ap_start();
+        wifi_ap_start(false);
+        // nothing to connect to until there's a config
+        vTaskDelete(NULL);
     } // else we're all good, yeah?
 
-    while (true) {
-        // we're either here because we just started connecting, or we've lost connection
-        xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
-        connect_wifi();
+    connect_wifi();
+
+    if (config_ap) {
+        ESP_LOGW(TAG, "Button A pressed, entering AP mode for config");
+        wifi_ap_start(true);
+    }
 
+    // connect_wifi() keeps at it by itself; we just open the config AP while it can't get through
+    bool outage_ap = false;
+    TickType_t wait = portMAX_DELAY;
+    while (true) {
         EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
-                    WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-                    pdFALSE,
+                    WIFI_RECOVERED_BIT | WIFI_FAIL_BIT,
+                    pdTRUE,
                     pdFALSE,
-                    portMAX_DELAY);
+                    wait);
+        wait = portMAX_DELAY;
 
-        if (bits & WIFI_CONNECTED_BIT) {
-            // we're good!
-            ESP_LOGI(TAG, "WiFi is up!");
-        } else if (bits & WIFI_FAIL_BIT) {
-            ESP_LOGW(TAG, "WiFi connection failed :(");
-            ESP_LOGW(TAG, "Starting AP mode...");
-            wifi_ap_start();
-        } else {
-            ESP_LOGE(TAG, "Got a weird WiFi event group bit, this should never happen");
-        }
+        // both bits might have been set since we last looked; go by where we are now
+        bool connected = (xEventGroupGetBits(wifi_event_group) & WIFI_CONNECTED_BIT) != 0;
 
-        // assume we're successful; wait until it fails again
-        // then repeat the loop again (or TODO AP mode)
-        xEventGroupWaitBits(wifi_event_group,
-                        WIFI_FAIL_BIT,
-                        pdFALSE,
-                        pdFALSE,
-                        portMAX_DELAY);
+        if (connected) {
+            if (bits & WIFI_RECOVERED_BIT) {
+                ESP_LOGI(TAG, "WiFi is up!");
+            }
+            if (outage_ap) {
+                // whoever just reconfigured us through the AP is likely still watching /status
+                TickType_t grace = wifi_ap_grace_left();
+                if (grace > 0) {
+                    wait = grace;
+                    continue;
+                }
+                wifi_ap_stop();
+                outage_ap = false;
+            }
+        } else if (!config_ap && !outage_ap) {
+            ESP_LOGW(TAG, "WiFi connection failed :( Starting AP mode while we keep trying...");
+            wifi_ap_start(true);
+            outage_ap = true;
+        }
     }
 }
\ No newline at end of file
@@ -1,7 +1,8 @@
 #include <freertos/event_groups.h>
 
 #define WIFI_CONNECTED_BIT      BIT0 // successful connection with IP
-#define WIFI_FAIL_BIT           BIT1 // we're still not connected even after trying MAXIMUM_RETRY times
+#define WIFI_FAIL_BIT           BIT1 // out of immediate retries, backing off; still trying though
+#define WIFI_RECOVERED_BIT      BIT2 // got an IP; for wifi_task, which clears it
 
 extern EventGroupHandle_t wifi_event_group;
 
@@ -13,9 +13,13 @@
 
 #include "../sling/sling_setup.h"
 #include "wifi_config.h"
+#include "wifi_sta.h"
 #include "url_decode.h"
  
 #define SERVER_PORT 80
+// how long the AP stays up after a new config is submitted, so /status can be checked; past the
+// 30 s it takes to fall back to the old config
+#define STATUS_GRACE_MS 60000
 
 static const char *TAG = "wifi_ap";
 
@@ -25,11 +29,15 @@ static const char *html_root_header = "<h1>welcome to esp-source</h1>";
 static const char *html_root_secret_f = "<p>Secret: <input disabled value=\"%s\"></p><br>";
 static const char *html_root_form_pt1 = "<form action=\"/set\" method=\"post\"><p><label>SSID: </label><input name=\"ssid\"></p><p><label>Auth type: </label><select name=\"authmode\" onchange=\"var id_p = document.getElementById('id_p').style; var pw_p = document.getElementById('pw_p').style; var val_p = document.getElementById('val_p').style; if (this.selectedIndex == 2) { val_p.display = 'table-row'; id_p.display = 'table-row'; } else { val_p.display = 'none'; id_p.display = 'none'; }; if (this.selectedIndex == 0) pw_p.display = 'none'; else pw_p.display = 'table-row';\">";
 static const char *html_root_form_authmode_f = "<option value=\"%d\">Open</option><option value=\"%d\">WPA2-PSK</option><option value=\"%d\">WPA2-Enterprise</option>";
-static const char *html_root_form_pt3 = "</select></p><p id=\"val_p\" style=\"display: none;\"><label>Validate CA: </label><input type=\"checkbox\" name=\"validate\" checked></p><p id=\"id_p\" style=\"display: none;\"><label>Identity: </label><input name=\"identity\"></p><p id=\"pw_p\" style=\"display: none;\"><label>Password: </label><input name=\"password\"></p><p><input type=\"submit\"></p></form>";
+static const char *html_root_form_pt3 = "</select></p><p id=\"val_p\" style=\"display: none;\"><label>Validate CA: </label><input type=\"checkbox\" name=\"validate\" checked></p><p id=\"id_p\" style=\"display: none;\"><label>Identity: </label><input name=\"identity\"></p><p id=\"pw_p\" style=\"display: none;\"><label>Password: </label><input name=\"password\"></p><p><label>Static IP (blank for DHCP): </label><input name=\"ip\"></p><p><label>Netmask: </label><input name=\"netmask\"></p><p><label>Gateway: </label><input name=\"gateway\"></p><p><label>DNS (blank for gateway): </label><input name=\"dns\"></p><p><input type=\"submit\"></p></form>";
 static const char *html_footer = "</body></html>";
  
 static httpd_handle_t httpServerInstance = NULL;
 
+// when the last config was submitted, if one was
+static volatile bool reconfigured = false;
+static volatile TickType_t reconfigured_at;
+
 static esp_err_t handler_get_root(httpd_req_t *req) {
     ESP_LOGI(TAG, "Got request to /");
 
@@ -65,8 +73,8 @@ static httpd_uri_t uri_get_root = {
 
 static esp_err_t handler_post_root(httpd_req_t *req) {
     ESP_LOGI(TAG, "Got request to /set");
-    char buffer[256] = {0};
-    httpd_req_recv(req, buffer, 256);
+    char buffer[384] = {0};
+    httpd_req_recv(req, buffer, sizeof(buffer) - 1);
     char temp[128] = {0};
 
     char ssid[32] = {0};
@@ -122,8 +130,25 @@ static esp_err_t handler_post_root(httpd_req_t *req) {
         }
     }
 
+    // all optional; dotted quads need no url decoding
+    char ip[16] = {0};
+    char netmask[16] = {0};
+    char gateway[16] = {0};
+    char dns[16] = {0};
+    httpd_query_key_value(buffer, "ip", ip, sizeof(ip));
+    httpd_query_key_value(buffer, "netmask", netmask, sizeof(netmask));
+    httpd_query_key_value(buffer, "gateway", gateway, sizeof(gateway));
+    httpd_query_key_value(buffer, "dns", dns, sizeof(dns));
+
+    if (wifi_update_static_ip(ip, netmask, gateway, dns) != 0) {
+        httpd_resp_set_status(req, "400");
+        httpd_resp_send(req, "Invalid static IP config", HTTPD_RESP_USE_STRLEN);
+        ESP_LOGW(TAG, "Got invalid static IP config");
+        return ESP_OK;
+    }
+
     int ret = wifi_update_config(ssid, authmode, validate, NULL, identity, password);
-    if (ret != 0) {
+    if (ret != 0 && ret != 3) {
         httpd_resp_set_status(req, "500");
         httpd_resp_send(req, "Error setting config: %d", ret);
         ESP_LOGE(TAG, "Error setting config: %d", ret);
@@ -131,10 +156,32 @@ static esp_err_t handler_post_root(httpd_req_t *req) {
     }
 
     ESP_LOGI(TAG, "New WiFi STA config! SSID: %s; Authmode: %d; Validate: %s; Identity: %s; Password: %s", ssid, authmode, validate ? "yes" : "no", identity, password);
-    httpd_resp_send(req, "Set successfully! :)", HTTPD_RESP_USE_STRLEN);
+
+    if (ret == 3) {
+        // first config; there's no STA to switch over yet, so start from the top with it
+        httpd_resp_send(req, "Set successfully! Restarting to connect...", HTTPD_RESP_USE_STRLEN);
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        esp_restart();
+    }
+
+    reconfigured_at = xTaskGetTickCount();
+    reconfigured = true;
+    httpd_resp_send(req, "Set successfully! Connecting with it now; see <a href=\"/status\">/status</a> for how it went.", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+static esp_err_t handler_get_status(httpd_req_t *req) {
+    httpd_resp_send(req, wifi_sta_status(), HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 
+static httpd_uri_t uri_get_status = {
+    .uri        = "/status",
+    .method     = HTTP_GET,
+    .handler    = handler_get_status,
+    .user_ctx   = NULL,
+};
+
 static httpd_uri_t uri_post_set = {
     .uri        = "/set",
     .method     = HTTP_POST,
@@ -149,15 +196,17 @@ static void startHttpServer(void){
     if (httpd_start(&httpServerInstance, &httpServerConfiguration) == ESP_OK) {
         ESP_ERROR_CHECK(httpd_register_uri_handler(httpServerInstance, &uri_get_root));
         ESP_ERROR_CHECK(httpd_register_uri_handler(httpServerInstance, &uri_post_set));
+        ESP_ERROR_CHECK(httpd_register_uri_handler(httpServerInstance, &uri_get_status));
     }
 }
  
-// static void stopHttpServer(void){
-//     if (httpServerInstance != NULL) {
-//         ESP_LOGI(TAG, "Stopping httpd");
-//         ESP_ERROR_CHECK(httpd_stop(httpServerInstance));
-//     }
-// }
+static void stopHttpServer(void){
+    if (httpServerInstance != NULL) {
+        ESP_LOGI(TAG, "Stopping httpd");
+        ESP_ERROR_CHECK(httpd_stop(httpServerInstance));
+        httpServerInstance = NULL;
+    }
+}
 
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                                     int32_t event_id, void* event_data) {
@@ -172,17 +221,24 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
     }
 }
  
-void wifi_ap_start() {
-    ESP_LOGI(TAG, "Starting AP mode");
+static esp_event_handler_instance_t s_ap_instance;
+
+void wifi_ap_start(bool sta) {
+    if (s_ap_instance != NULL) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Starting AP mode%s", sta ? " alongside STA" : "");
 
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                         ESP_EVENT_ANY_ID,
                                                         &wifi_event_handler,
                                                         NULL,
-                                                        NULL));
+                                                        &s_ap_instance));
 
     ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_AP));
+    // the AP shares the STA's radio, so it follows the STA onto whatever channel it's scanning
+    ESP_ERROR_CHECK(esp_wifi_set_mode(sta ? WIFI_MODE_APSTA : WIFI_MODE_AP));
 
     wifi_config_t apConfiguration = {
         .ap = {
@@ -207,9 +263,30 @@ void wifi_ap_start() {
 
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &apConfiguration));
     
-    ESP_ERROR_CHECK(esp_wifi_start());
+    // with STA, connect_wifi() already started it
+    if (!sta) {
+        ESP_ERROR_CHECK(esp_wifi_start());
+    }
 
     startHttpServer();
+}
+
+TickType_t wifi_ap_grace_left() {
+    TickType_t since = xTaskGetTickCount() - reconfigured_at;
+    if (!reconfigured || since >= pdMS_TO_TICKS(STATUS_GRACE_MS)) {
+        return 0;
+    }
+    return pdMS_TO_TICKS(STATUS_GRACE_MS) - since;
+}
+
+void wifi_ap_stop() {
+    if (s_ap_instance == NULL) {
+        return;
+    }
 
-    while(1) vTaskDelay(10);
+    ESP_LOGI(TAG, "Stopping AP mode");
+    stopHttpServer();
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, s_ap_instance));
+    s_ap_instance = NULL;
 }
\ No newline at end of file
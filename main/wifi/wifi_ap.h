@@ -1 +1,17 @@
-void wifi_ap_start();
\ No newline at end of file
+#include <stdbool.h>
+
+#include <freertos/FreeRTOS.h>
+
+/**
+ * starts the config AP and its web server, and returns
+ *
+ * with sta, the AP runs alongside the STA connection (which must already be started) instead of
+ * replacing it. does nothing if the AP is already up.
+ */
+void wifi_ap_start(bool sta);
+
+// back to just STA; only for an AP started with sta
+void wifi_ap_stop();
+
+// ticks until the AP can go, once a new config was submitted; /status should outlive the switch
+TickType_t wifi_ap_grace_left();
\ No newline at end of file
@@ -5,19 +5,20 @@
 #include <esp_log.h>
 #include <esp_wifi.h>
 #include <esp_wpa2.h>
-#include <nvs_flash.h>
+#include <lwip/ip4_addr.h>
 
 #include "../storage/spiffs.h"
+#include "../storage/config_store.h"
+#include "wifi_config.h"
+#include "wifi_sta.h"
 
 static const char *TAG = "wifi_config";
 
 extern const uint8_t digicert_global_crt_start[]   asm("_binary_digicert_global_crt_start");
 extern const uint8_t digicert_global_crt_end[]     asm("_binary_digicert_global_crt_end");
 
-#define NVS_NAMESPACE "wifi"
-
 /**
- * wifi storage in nvs, v0.1:
+ * wifi storage in nvs, v0.1; config_store keeps a copy in RAM:
  * - conf_version       uint8_t                     version of config, in case we need to change it. let's just say it's 1 for now
  * 
  * - sta_ssid           uint8_t[32]                 SSID of target AP
@@ -25,10 +26,61 @@ extern const uint8_t digicert_global_crt_end[]     asm("_binary_digicert_global_
  * - sta_validate_ca    uint8_t                     whether or not to validate cacert (0 = no, 1 = yes). if can't read cacert, fall back to digicert (for auth01.nw.nus.edu.sg)
  * - sta_identity       uint8_t[64]                 identity. aka username?
  * - sta_password       uint8_t[64]                 passphrase for target AP, or for WPA2 enterprise
+ * - sta_hint           struct wifi_hint            BSSID and channel we last got an IP on; wiped with the rest of the STA config
+ * - sta_ip             uint32_t                    static IP, if set. otherwise DHCP
+ * - sta_netmask        uint32_t                    static IP netmask
+ * - sta_gw             uint32_t                    static IP gateway
+ * - sta_dns            uint32_t                    static IP DNS server; the gateway if not set
  * 
  * pem ca cert goes into spiffs partition "certs" as "wifi_8021x_ca_cert.pem"
  */
 
+// writes settings to NVS in one batch. the CA cert is separate, in spiffs
+int wifi_save_config(const struct wifi_sta_settings *settings) {
+    switch (settings->authmode) {
+        case WIFI_AUTH_WPA2_ENTERPRISE:
+        case WIFI_AUTH_WPA3_PSK:
+        case WIFI_AUTH_WPA2_WPA3_PSK:
+        case WIFI_AUTH_WPA2_PSK:
+        case WIFI_AUTH_OPEN:
+            break;
+        default:
+            ESP_LOGE(TAG, "Got unknown authmode %d in save_config!", settings->authmode);
+            return 1;
+    }
+
+    struct config *config = config_store_begin();
+    struct config_wifi *wifi = &config->wifi;
+
+    // zeroed first, so leftovers past the terminators don't count as a change
+    memset(wifi->ssid, 0, sizeof(wifi->ssid));
+    memset(wifi->identity, 0, sizeof(wifi->identity));
+    memset(wifi->password, 0, sizeof(wifi->password));
+
+    wifi->configured = true;
+    wifi->authmode = settings->authmode;
+    strlcpy(wifi->ssid, settings->ssid, sizeof(wifi->ssid));
+    // only what the authmode uses is kept
+    if (settings->authmode != WIFI_AUTH_OPEN) {
+        strlcpy(wifi->password, settings->password, sizeof(wifi->password));
+    }
+    if (settings->authmode == WIFI_AUTH_WPA2_ENTERPRISE) {
+        wifi->validate_cacert = settings->validate_cacert;
+        strlcpy(wifi->identity, settings->identity, sizeof(wifi->identity));
+    } else {
+        wifi->validate_cacert = false;
+    }
+
+    // the hint was for the old AP
+    wifi->has_hint = false;
+    memset(&wifi->hint, 0, sizeof(wifi->hint));
+
+    if (config_store_commit() != 0) {
+        return 2;
+    }
+    return 0;
+}
+
 /**
  *  every char* should be a null-terminated string
  * even ca_cert, since we're taking PEM certs
@@ -38,22 +90,16 @@ extern const uint8_t digicert_global_crt_end[]     asm("_binary_digicert_global_
  * else write to spiffs
  * 
  * required parameters depends on authmode
+ *
+ * the STA switches over to the new config right away, and goes back to the old one if it
+ * doesn't get an IP in time. returns 3 if the config is saved but the STA isn't running to
+ * switch over; it'll be used after a restart
  */
 int wifi_update_config(char *ssid, wifi_auth_mode_t authmode, bool validate_cacert, char *ca_cert, char *identity, char *password) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-
-    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Got error %s while opening NVS namespace", esp_err_to_name(err));
-        return 100;
-    }
-
     switch (authmode) {
         case WIFI_AUTH_WPA2_ENTERPRISE:
             if (identity == NULL) {
                 ESP_LOGE(TAG, "Got null identity in update_config!");
-                nvs_close(nvs_handle);
                 return 1;
             }
             // fallthrough
@@ -62,187 +108,116 @@ int wifi_update_config(char *ssid, wifi_auth_mode_t authmode, bool validate_cace
         case WIFI_AUTH_WPA2_PSK:
             if (password == NULL) {
                 ESP_LOGE(TAG, "Got null password in update_config!");
-                nvs_close(nvs_handle);
                 return 1;
             }
             // fallthrough
         case WIFI_AUTH_OPEN:
             if (ssid == NULL) {
                 ESP_LOGE(TAG, "Got null ssid in update_config!");
-                nvs_close(nvs_handle);
                 return 1;
             }
             break;
         default: // include open
             ESP_LOGE(TAG, "Got unknown authmode %d in update_config!", authmode);
-            nvs_close(nvs_handle);
             return 1;
     }
 
-    // do this again because we don't really want to save half of the settings before realizing that we're missing some stuff
-    switch (authmode) {
-        case WIFI_AUTH_WPA2_ENTERPRISE:
-            err = nvs_set_u8(nvs_handle, "sta_validate_ca", validate_cacert ? 1 : 0);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Error saving sta_validate_ca to NVS: %s", esp_err_to_name(err));
-                nvs_close(nvs_handle);
-                return 2;
-            }
+    // to go back to if the new one doesn't work out
+    struct wifi_sta_settings previous;
+    bool has_previous = wifi_read_config(&previous) == 0;
 
-            if (validate_cacert) {
-                if (ca_cert != NULL) {
-                    if (strlen(ca_cert) == 0) {
-                        spiffs_delete("certs", "wifi_8021x_ca_cert.pem"); // ignore if delete fails
-                    } else {
-                        int ret = spiffs_write("certs", "wifi_8021x_ca_cert.pem", ca_cert, strlen(ca_cert) + 1);
-                        if (ret != 0) {
-                            ESP_LOGE(TAG, "Error %d while saving /certs/wifi_8021x_ca_cert.pem", ret);
-                            nvs_close(nvs_handle);
-                            return 2;
-                        }
-                    }
-                }
-            }
-            
-            err = nvs_set_str(nvs_handle, "sta_identity", identity);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Error saving sta_identity to NVS: %s", esp_err_to_name(err));
-                nvs_close(nvs_handle);
-                return 2;
-            }
-            // fallthrough
-        case WIFI_AUTH_WPA3_PSK:
-        case WIFI_AUTH_WPA2_WPA3_PSK:
-        case WIFI_AUTH_WPA2_PSK:
-            err = nvs_set_str(nvs_handle, "sta_password", password);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Error saving sta_password to NVS: %s", esp_err_to_name(err));
-                nvs_close(nvs_handle);
-                return 2;
-            }
-            // fallthrough
-        case WIFI_AUTH_OPEN:
-            err = nvs_set_str(nvs_handle, "sta_ssid", ssid);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Error saving sta_ssid to NVS: %s", esp_err_to_name(err));
-                nvs_close(nvs_handle);
-                return 2;
-            }
-            
-            err = nvs_set_u8(nvs_handle, "sta_authmode", (uint8_t) authmode);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Error saving sta_authmode to NVS: %s", esp_err_to_name(err));
-                nvs_close(nvs_handle);
+    struct wifi_sta_settings settings = {
+        .authmode = authmode,
+        .validate_cacert = validate_cacert,
+    };
+    strlcpy(settings.ssid, ssid, sizeof(settings.ssid));
+    if (password != NULL) {
+        strlcpy(settings.password, password, sizeof(settings.password));
+    }
+    if (identity != NULL) {
+        strlcpy(settings.identity, identity, sizeof(settings.identity));
+    }
+
+    if (authmode == WIFI_AUTH_WPA2_ENTERPRISE && validate_cacert && ca_cert != NULL) {
+        if (strlen(ca_cert) == 0) {
+            spiffs_delete("certs", "wifi_8021x_ca_cert.pem"); // ignore if delete fails
+        } else {
+            int ret = spiffs_write("certs", "wifi_8021x_ca_cert.pem", ca_cert, strlen(ca_cert) + 1);
+            if (ret != 0) {
+                ESP_LOGE(TAG, "Error %d while saving /certs/wifi_8021x_ca_cert.pem", ret);
                 return 2;
             }
-            break;
-        default: // include open
-            ESP_LOGE(TAG, "Got unknown authmode %d in update_config!", authmode);
-            nvs_close(nvs_handle);
-            return 1;
+        }
     }
 
-    err = nvs_set_u8(nvs_handle, "conf_version", 1);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error saving conf_version to NVS: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return 2;
+    int ret = wifi_save_config(&settings);
+    if (ret != 0) {
+        return ret;
     }
 
-    nvs_commit(nvs_handle);
-    nvs_close(nvs_handle);
+    if (wifi_sta_reconfigure(has_previous ? &previous : NULL) != 0) {
+        return 3;
+    }
     return 0;
 }
 
 /**
- * load wifi config rightaway
+ * reads the STA config, as loaded from NVS at boot or last saved
  * 
  * returns 1 if config not found or invalid config
- * returns 2 if conf_version exists but failed getting other params
- * returns 100 if nvs namespace couldn't be opened
  * returns 0 if it's all good
  */
-int wifi_load_config() {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
+int wifi_read_config(struct wifi_sta_settings *settings) {
+    struct config config;
+    config_store_get(&config);
 
-    err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Got error %s while opening NVS namespace", esp_err_to_name(err));
-        return 100;
-    }
-
-    uint8_t version;
-    err = nvs_get_u8(nvs_handle, "conf_version", &version);
-    if (version != 1 || err == ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGW(TAG, "Config not found, or invalid config (wrong version?)");
-        nvs_close(nvs_handle);
+    if (!config.wifi.configured) {
         return 1;
     }
 
+    memset(settings, 0, sizeof(*settings));
+    settings->authmode = config.wifi.authmode;
+    settings->validate_cacert = config.wifi.validate_cacert;
+    strlcpy(settings->ssid, config.wifi.ssid, sizeof(settings->ssid));
+    strlcpy(settings->identity, config.wifi.identity, sizeof(settings->identity));
+    strlcpy(settings->password, config.wifi.password, sizeof(settings->password));
+    return 0;
+}
+
+/**
+ * hands settings to the WiFi driver; takes effect on the next connect
+ *
+ * returns 1 if the authmode is invalid, 2 if the CA cert couldn't be read, 0 if it's all good
+ */
+int wifi_apply_config(const struct wifi_sta_settings *settings) {
+    wifi_auth_mode_t authmode = settings->authmode;
     wifi_config_t conf = {
         .sta = {
-            // .ssid = (unsigned char) ssid,
-            // .threshold.authmode = authmode,
+            .threshold.authmode = authmode,
         },
     };
-    
-    err = nvs_get_u8(nvs_handle, "sta_authmode", (uint8_t *) &(conf.sta.threshold.authmode));
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error getting sta_authmode: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return 2;
-    }
-    wifi_auth_mode_t authmode = conf.sta.threshold.authmode;
-
-    size_t ssid_len = 32;
-    err = nvs_get_str(nvs_handle, "sta_ssid", (char *) conf.sta.ssid, &ssid_len);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error getting sta_ssid: %s", esp_err_to_name(err));
-        nvs_close(nvs_handle);
-        return 2;
-    }
-
-    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-
-    char password[64] = {0};
-    size_t pw_len = 64;
-
-    if (authmode != WIFI_AUTH_OPEN) {
-        err = nvs_get_str(nvs_handle, "sta_password", password, &pw_len);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error getting sta_password: %s", esp_err_to_name(err));
-            nvs_close(nvs_handle);
-            return 2;
-        }
-    }
+    // a 32-char SSID fills the field without a null terminator
+    memcpy(conf.sta.ssid, settings->ssid, strnlen(settings->ssid, sizeof(conf.sta.ssid)));
 
     if (authmode != WIFI_AUTH_WPA2_ENTERPRISE) {
         if (authmode == WIFI_AUTH_WPA3_PSK ||
             authmode == WIFI_AUTH_WPA2_WPA3_PSK ||
             authmode == WIFI_AUTH_WPA2_PSK) {
-                strcpy((char *) conf.sta.password, password);
+                strlcpy((char *) conf.sta.password, settings->password, sizeof(conf.sta.password));
         } else if (authmode != WIFI_AUTH_OPEN) {
             ESP_LOGE(TAG, "Unknown or invalid authmode %d.", authmode);
-            nvs_close(nvs_handle);
             return 1;
         }
 
+        // in case we're switching away from 802.1x
+        esp_wifi_sta_wpa2_ent_disable();
+
         ESP_LOGI(TAG, "Connecting to WiFi with ssid: %s; authmode: %d", conf.sta.ssid, authmode);
         esp_wifi_set_config(WIFI_IF_STA, &conf);
     } else { // 802.1x/wpa2 enterprise
         esp_wifi_set_config(WIFI_IF_STA, &conf);
 
-        uint8_t validate_ca_int;
-        err = nvs_get_u8(nvs_handle, "sta_validate_ca", &validate_ca_int);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error getting sta_validate_ca: %s", esp_err_to_name(err));
-            nvs_close(nvs_handle);
-            return 2;
-        }
-
-        if (validate_ca_int == 1) {
+        if (settings->validate_cacert) {
             size_t cacert_len;
             char *cacert = NULL;
 
@@ -253,33 +228,106 @@ int wifi_load_config() {
                 ESP_ERROR_CHECK(esp_wifi_sta_wpa2_ent_set_ca_cert((const unsigned char *) cacert, cacert_len));
             } else {
                 ESP_LOGE(TAG, "Error %d while reading /certs/wifi_802x_ca_cert.pem", res);
-                nvs_close(nvs_handle);
                 return 2;
             }
         } else {
             esp_wifi_sta_wpa2_ent_clear_ca_cert();
         }
 
-        char identity[64] = {0};
-        size_t id_len = 64;
-        err = nvs_get_str(nvs_handle, "sta_identity", identity, &id_len);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error getting sta_identity: %s", esp_err_to_name(err));
-            nvs_close(nvs_handle);
-            return 2;
-        }
+        const char *identity = settings->identity;
         ESP_ERROR_CHECK(esp_wifi_sta_wpa2_ent_set_identity((const unsigned char *) identity, strlen(identity)));
         ESP_ERROR_CHECK(esp_wifi_sta_wpa2_ent_set_username((const unsigned char *) identity, strlen(identity)));
 
-        ESP_ERROR_CHECK(esp_wifi_sta_wpa2_ent_set_password((const unsigned char *) password, strlen(password)));
+        ESP_ERROR_CHECK(esp_wifi_sta_wpa2_ent_set_password((const unsigned char *) settings->password, strlen(settings->password)));
 
         ESP_ERROR_CHECK(esp_wifi_sta_wpa2_ent_set_ttls_phase2_method(ESP_EAP_TTLS_PHASE2_MSCHAPV2));
 
         ESP_ERROR_CHECK(esp_wifi_sta_wpa2_ent_enable());
 
-        ESP_LOGI(TAG, "Connecting to WiFi with ssid: %s; authmode: %d; validate: %d; identity: %s", conf.sta.ssid, authmode, validate_ca_int, identity);
+        ESP_LOGI(TAG, "Connecting to WiFi with ssid: %s; authmode: %d; validate: %d; identity: %s", conf.sta.ssid, authmode, settings->validate_cacert, identity);
+    }
+
+    return 0;
+}
+
+/**
+ * load wifi config rightaway
+ * 
+ * returns 1 if config not found or invalid config
+ * returns 0 if it's all good
+ */
+int wifi_load_config() {
+    struct wifi_sta_settings settings;
+    int ret = wifi_read_config(&settings);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+
+    return wifi_apply_config(&settings);
+}
+
+int wifi_load_hint(struct wifi_hint *hint) {
+    struct config config;
+    config_store_get(&config);
+
+    if (!config.wifi.has_hint) {
+        return 1;
     }
+    *hint = config.wifi.hint;
+    return 0;
+}
 
-    nvs_close(nvs_handle);
+int wifi_save_hint(const struct wifi_hint *hint) {
+    struct config *config = config_store_begin();
+    config->wifi.has_hint = true;
+    config->wifi.hint = *hint;
+    return config_store_commit() == 0 ? 0 : 2;
+}
+
+int wifi_load_static_ip(esp_netif_ip_info_t *ip_info, esp_netif_dns_info_t *dns) {
+    struct config config;
+    config_store_get(&config);
+
+    memset(ip_info, 0, sizeof(*ip_info));
+    memset(dns, 0, sizeof(*dns));
+
+    if (config.wifi.ip == 0) { // not set, so DHCP
+        return 1;
+    }
+
+    ip_info->ip.addr = config.wifi.ip;
+    ip_info->netmask.addr = config.wifi.netmask;
+    ip_info->gw.addr = config.wifi.gw;
+    dns->ip.u_addr.ip4.addr = config.wifi.dns != 0 ? config.wifi.dns : config.wifi.gw;
+    dns->ip.type = ESP_IPADDR_TYPE_V4;
     return 0;
-}
\ No newline at end of file
+}
+
+// returns false if addr isn't a dotted quad
+static bool parse_ip(const char *addr, uint32_t *out) {
+    *out = esp_ip4addr_aton(addr);
+    // also what a malformed address comes back as
+    return *out != IPADDR_NONE;
+}
+
+int wifi_update_static_ip(const char *ip, const char *netmask, const char *gateway, const char *dns) {
+    // back to DHCP if there's no ip
+    uint32_t ip_addr = 0, netmask_addr = 0, gw_addr = 0, dns_addr = 0;
+    if (ip != NULL && strlen(ip) > 0
+        && (!parse_ip(ip, &ip_addr) || netmask == NULL || !parse_ip(netmask, &netmask_addr)
+            || gateway == NULL || !parse_ip(gateway, &gw_addr)
+            || (dns != NULL && strlen(dns) > 0 && !parse_ip(dns, &dns_addr)))) {
+        ESP_LOGE(TAG, "Got invalid static IP config in update_static_ip!");
+        return 1;
+    }
+
+    struct config *config = config_store_begin();
+    config->wifi.ip = ip_addr;
+    config->wifi.netmask = netmask_addr;
+    config->wifi.gw = gw_addr;
+    config->wifi.dns = dns_addr;
+    return config_store_commit() == 0 ? 0 : 2;
+}
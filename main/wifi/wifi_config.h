@@ -1,5 +1,40 @@
+#ifndef WIFI_CONFIG_H
+#define WIFI_CONFIG_H
+
 #include <esp_wifi_types.h>
+#include <esp_netif.h>
+
+#include "wifi_connect.h"
+
+// the STA part of the config in NVS
+struct wifi_sta_settings {
+    char ssid[33];
+    wifi_auth_mode_t authmode;
+    bool validate_cacert;
+    char identity[64];
+    char password[64];
+};
 
 int wifi_update_config(char *ssid, wifi_auth_mode_t authmode, bool validate_cacert, char *ca_cert, char *identity, char *password);
 
-int wifi_load_config();
\ No newline at end of file
+int wifi_load_config();
+
+int wifi_read_config(struct wifi_sta_settings *settings);
+int wifi_save_config(const struct wifi_sta_settings *settings);
+int wifi_apply_config(const struct wifi_sta_settings *settings);
+
+// returns 0 if there's a hint for the configured SSID
+int wifi_load_hint(struct wifi_hint *hint);
+int wifi_save_hint(const struct wifi_hint *hint);
+
+// returns 0 if a static IP is configured; otherwise use DHCP
+int wifi_load_static_ip(esp_netif_ip_info_t *ip_info, esp_netif_dns_info_t *dns);
+
+/**
+ * sets a static IP in dotted-quad notation; an empty ip goes back to DHCP
+ *
+ * dns may be empty, in which case the gateway is used
+ */
+int wifi_update_static_ip(const char *ip, const char *netmask, const char *gateway, const char *dns);
+
+#endif
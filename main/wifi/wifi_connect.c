@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "wifi_connect.h"
+
+// attempts at the hinted AP before scanning; it's either there or it isn't
+#define FAST_PATH_TRIES 1
+// scans in a row before backing off
+#define FULL_PATH_TRIES 3
+
+#define BACKOFF_BASE_US 1000000LL
+#define BACKOFF_MAX_US 60000000LL
+
+static void associate(struct wifi_connect *conn) {
+    conn->state = wifi_state_associating;
+    conn->ops->associate(conn->path == wifi_path_fast ? &conn->hint : NULL);
+}
+
+// somewhere between half and all of base * 2^backoffs, capped
+static int64_t backoff_delay(struct wifi_connect *conn) {
+    int64_t delay = BACKOFF_MAX_US;
+    if (conn->backoffs < 6 && (BACKOFF_BASE_US << conn->backoffs) < BACKOFF_MAX_US) {
+        delay = BACKOFF_BASE_US << conn->backoffs;
+    }
+    return delay / 2 + conn->ops->random() % (delay / 2 + 1);
+}
+
+void wifi_connect_init(struct wifi_connect *conn, const struct wifi_connect_ops *ops, const struct wifi_hint *hint) {
+    memset(conn, 0, sizeof(*conn));
+    conn->ops = ops;
+    conn->state = wifi_state_idle;
+    if (hint != NULL) {
+        conn->has_hint = true;
+        conn->hint = *hint;
+    }
+}
+
+void wifi_connect_start(struct wifi_connect *conn) {
+    conn->path = conn->has_hint ? wifi_path_fast : wifi_path_full;
+    conn->retries = 0;
+    conn->started_at = conn->ops->now_us();
+    associate(conn);
+}
+
+void wifi_connect_associated(struct wifi_connect *conn, const struct wifi_hint *ap) {
+    conn->current = *ap;
+    conn->state = wifi_state_waiting_ip;
+}
+
+enum wifi_connect_state wifi_connect_disconnected(struct wifi_connect *conn) {
+    switch (conn->state) {
+        case wifi_state_connected:
+            // lost the AP we were on; it's probably still the best bet
+            wifi_connect_start(conn);
+            break;
+
+        case wifi_state_associating:
+        case wifi_state_waiting_ip:
+            conn->retries++;
+            if (conn->path == wifi_path_fast && conn->retries >= FAST_PATH_TRIES) {
+                conn->path = wifi_path_full;
+                conn->retries = 0;
+                associate(conn);
+            } else if (conn->path == wifi_path_full && conn->retries >= FULL_PATH_TRIES) {
+                conn->state = wifi_state_backoff;
+                conn->ops->schedule(backoff_delay(conn));
+                conn->backoffs++;
+            } else {
+                associate(conn);
+            }
+            break;
+
+        case wifi_state_idle:
+        case wifi_state_backoff:
+            break;
+    }
+
+    return conn->state;
+}
+
+void wifi_connect_backoff_expired(struct wifi_connect *conn) {
+    if (conn->state != wifi_state_backoff) {
+        return;
+    }
+
+    // the hinted AP is likely the one that went away; scan, and take whichever is back first
+    conn->path = wifi_path_full;
+    conn->retries = 0;
+    associate(conn);
+}
+
+int64_t wifi_connect_got_ip(struct wifi_connect *conn) {
+    conn->state = wifi_state_connected;
+    conn->backoffs = 0;
+
+    if (!conn->has_hint || memcmp(&conn->hint, &conn->current, sizeof(conn->hint)) != 0) {
+        conn->hint = conn->current;
+        conn->has_hint = true;
+        conn->ops->save_hint(&conn->hint);
+    }
+
+    return conn->ops->now_us() - conn->started_at;
+}
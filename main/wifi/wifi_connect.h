@@ -0,0 +1,82 @@
+#ifndef WIFI_CONNECT_H
+#define WIFI_CONNECT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// the AP we last got an IP from, so the next connect can skip the scan
+struct wifi_hint {
+    uint8_t bssid[6];
+    uint8_t channel;
+};
+
+enum wifi_connect_path {
+    // straight to the hinted AP
+    wifi_path_fast,
+    // scan for the SSID, like a fresh device would
+    wifi_path_full,
+};
+
+enum wifi_connect_state {
+    wifi_state_idle,
+    wifi_state_associating,
+    wifi_state_waiting_ip,
+    wifi_state_connected,
+    // out of immediate retries; waiting for ops->schedule() to come back around
+    wifi_state_backoff,
+};
+
+/**
+ * what the state machine drives
+ *
+ * wifi_sta.c has the ones backed by the WiFi driver. the state machine itself doesn't touch
+ * ESP-IDF, so it can be run against a simulated driver instead.
+ */
+struct wifi_connect_ops {
+    // starts associating with the hinted AP, or with whichever AP a scan finds if hint is NULL
+    void (*associate)(const struct wifi_hint *hint);
+    // called when we got an IP from an AP other than the hinted one
+    void (*save_hint)(const struct wifi_hint *hint);
+    // calls wifi_connect_backoff_expired() after delay_us
+    void (*schedule)(int64_t delay_us);
+    int64_t (*now_us)(void);
+    uint32_t (*random)(void);
+};
+
+struct wifi_connect {
+    const struct wifi_connect_ops *ops;
+    enum wifi_connect_state state;
+    enum wifi_connect_path path;
+    bool has_hint;
+    struct wifi_hint hint;
+    // the AP we're associated with, once we are
+    struct wifi_hint current;
+    int retries;
+    // how many times we've backed off since we last had an IP
+    int backoffs;
+    int64_t started_at;
+};
+
+// hint may be NULL if there isn't one yet
+void wifi_connect_init(struct wifi_connect *conn, const struct wifi_connect_ops *ops, const struct wifi_hint *hint);
+
+// starts connecting, on the fast path if there's a hint
+void wifi_connect_start(struct wifi_connect *conn);
+
+void wifi_connect_associated(struct wifi_connect *conn, const struct wifi_hint *ap);
+
+/**
+ * retries, falling back to the full path if the fast one didn't work out
+ *
+ * once the full path runs out of immediate retries, it keeps trying with exponential backoff,
+ * jittered so a fleet that lost the same AP doesn't come back all at once. returns
+ * wifi_state_backoff when it starts waiting.
+ */
+enum wifi_connect_state wifi_connect_disconnected(struct wifi_connect *conn);
+
+void wifi_connect_backoff_expired(struct wifi_connect *conn);
+
+// returns how long it took to get an IP since wifi_connect_start(), in microseconds
+int64_t wifi_connect_got_ip(struct wifi_connect *conn);
+
+#endif
@@ -7,24 +7,52 @@
 #include "esp_event.h"
 #include "esp_task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
 #include "wifi.h"
-
-// TODO move config elsewhere
-#define EXAMPLE_ESP_MAXIMUM_RETRY  10
+#include "wifi_sta.h"
+#include "wifi_config.h"
+#include "wifi_connect.h"
 
 static esp_event_handler_instance_t s_wifi_instance_any_id;
 static esp_event_handler_instance_t s_wifi_instance_got_ip;
 
-#define WIFI_CONNECTED_BIT      BIT0 // successful connection with IP
-#define WIFI_FAIL_BIT           BIT1 // we're still not connected even after trying MAXIMUM_RETRY times
-
 static const char *TAG = "wifi_sta";
 
-static int s_retry_num = 0;
+// backoff timer expiries, posted to the default loop so the state machine only runs on that task
+ESP_EVENT_DEFINE_BASE(WIFI_CONNECT_EVENT);
+#define WIFI_CONNECT_EVENT_RETRY 0
+#define WIFI_CONNECT_EVENT_RECONFIGURE 1
+#define WIFI_CONNECT_EVENT_ROLLBACK 2
+
+// how long a new config gets to come up with an IP before we go back to the old one
+#define RECONFIGURE_DEADLINE_US 30000000LL
+// how long to wait for the disconnect event after leaving on purpose; it may never come, e.g.
+// if the STA was scanning
+#define LEAVE_TIMEOUT_US 1000000LL
+
+static esp_event_handler_instance_t s_connect_instance;
+static esp_timer_handle_t s_backoff_timer;
+static esp_timer_handle_t s_rollback_timer;
+
+static struct wifi_connect s_connect;
+
+struct reconfigure_params {
+    bool has_previous;
+    struct wifi_sta_settings previous;
+};
+
+// the config to go back to, while a new one is on trial
+static bool s_has_rollback = false;
+static struct wifi_sta_settings s_rollback;
+static int64_t s_reconfigured_at;
+// we disconnected on purpose, and the new config waits for the disconnect event (whatever its
+// reason), or LEAVE_TIMEOUT_US on the backoff timer, before it starts
+static bool s_leaving = false;
+static const char *volatile s_status = "No changes yet";
 
 static void evgrp_set_bits(EventBits_t bits) {
     if (wifi_event_group != NULL) {
@@ -34,44 +62,224 @@ static void evgrp_set_bits(EventBits_t bits) {
     }
 }
 
+static void sta_associate(const struct wifi_hint *hint) {
+    wifi_config_t conf;
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &conf));
+
+    // with the channel set, the driver only scans that one channel
+    if (hint != NULL) {
+        ESP_LOGI(TAG, "Connecting to " MACSTR " on channel %d", MAC2STR(hint->bssid), hint->channel);
+        conf.sta.bssid_set = true;
+        memcpy(conf.sta.bssid, hint->bssid, sizeof(conf.sta.bssid));
+        conf.sta.channel = hint->channel;
+    } else {
+        ESP_LOGI(TAG, "Scanning for %s", conf.sta.ssid);
+        conf.sta.bssid_set = false;
+        conf.sta.channel = 0;
+    }
+
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &conf));
+    esp_wifi_connect();
+}
+
+static void sta_save_hint(const struct wifi_hint *hint) {
+    wifi_save_hint(hint);
+}
+
+static void sta_schedule(int64_t delay_us) {
+    ESP_LOGI(TAG, "Retrying in %lld ms", delay_us / 1000);
+    ESP_ERROR_CHECK(esp_timer_start_once(s_backoff_timer, delay_us));
+}
+
+static int64_t sta_now_us(void) {
+    return esp_timer_get_time();
+}
+
+static const struct wifi_connect_ops sta_ops = {
+    .associate = sta_associate,
+    .save_hint = sta_save_hint,
+    .schedule = sta_schedule,
+    .now_us = sta_now_us,
+    .random = esp_random,
+};
+
+static void backoff_expired(void *arg) {
+    esp_event_post(WIFI_CONNECT_EVENT, WIFI_CONNECT_EVENT_RETRY, NULL, 0, 0);
+}
+
+static void rollback_expired(void *arg) {
+    esp_event_post(WIFI_CONNECT_EVENT, WIFI_CONNECT_EVENT_ROLLBACK, NULL, 0, 0);
+}
+
+static void apply_ip_config(void);
+
+// the old connection is gone, or we've given up waiting to hear that it is
+static void finish_leaving(void) {
+    esp_timer_stop(s_backoff_timer);
+    s_leaving = false;
+    wifi_connect_start(&s_connect);
+}
+
+// drops whatever connection we have, and starts over with the config in NVS
+static void switch_config(void) {
+    esp_timer_stop(s_backoff_timer); // fine if it's not running
+    xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+
+    // still leaving, if this is a second reconfigure before the first one got going
+    if (s_connect.state != wifi_state_idle && s_connect.state != wifi_state_backoff) {
+        esp_wifi_disconnect();
+        s_leaving = true;
+    }
+
+    struct wifi_sta_settings settings;
+    if (wifi_read_config(&settings) != 0 || wifi_apply_config(&settings) != 0) {
+        ESP_LOGE(TAG, "Couldn't load the new config, trying anyway");
+    }
+    apply_ip_config();
+
+    // the old AP's hint is no use
+    wifi_connect_init(&s_connect, &sta_ops, NULL);
+    s_reconfigured_at = esp_timer_get_time();
+    if (s_leaving) {
+        ESP_ERROR_CHECK(esp_timer_start_once(s_backoff_timer, LEAVE_TIMEOUT_US));
+    } else {
+        wifi_connect_start(&s_connect);
+    }
+
+    if (s_has_rollback) {
+        esp_timer_stop(s_rollback_timer);
+        ESP_ERROR_CHECK(esp_timer_start_once(s_rollback_timer, RECONFIGURE_DEADLINE_US));
+    }
+}
+
 // TODO figure out what happens if we get connected but DHCP isn't working
 // event_sta_connected but no event_sta_got_ip? or is there another ip_event for DHCP timeouts?
 static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
+        wifi_connect_start(&s_connect);
+    } else if (s_leaving && ((event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+                             || (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP))) {
+        // the old connection's, from before we left
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *) event_data;
+        struct wifi_hint ap = { .channel = event->channel };
+        memcpy(ap.bssid, event->bssid, sizeof(ap.bssid));
+        wifi_connect_associated(&s_connect, &ap);
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
-            s_retry_num++;
-            ESP_LOGI(TAG, "Disconnected :( Retrying, retry #%d", s_retry_num);
-            esp_wifi_connect();
-            
-        } else {
-            ESP_LOGI(TAG, "Connection failed %d times, giving up", s_retry_num);
-            evgrp_set_bits(WIFI_FAIL_BIT);
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *) event_data;
+        if (s_leaving) {
+            ESP_LOGI(TAG, "Left the old AP (reason %d)", event->reason);
+            finish_leaving();
+            return;
+        }
+
+        if (s_connect.state == wifi_state_connected) {
+            xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        }
 
-            // it's out of our hands now
-            ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, s_wifi_instance_got_ip));
-            ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, s_wifi_instance_any_id));
-            ESP_ERROR_CHECK(esp_wifi_stop());
-            s_retry_num = 0;
+        if (wifi_connect_disconnected(&s_connect) == wifi_state_backoff) {
+            // not giving up, but let wifi_task open the config AP in the meantime
+            evgrp_set_bits(WIFI_FAIL_BIT);
+        } else {
+            ESP_LOGI(TAG, "Disconnected :( Retrying, %s path retry #%d",
+                s_connect.path == wifi_path_fast ? "fast" : "full", s_connect.retries);
+        }
+    } else if (event_base == WIFI_CONNECT_EVENT && event_id == WIFI_CONNECT_EVENT_RETRY) {
+        if (s_leaving) {
+            ESP_LOGW(TAG, "No disconnect event after leaving the old AP, starting anyway");
+            finish_leaving();
+        } else {
+            wifi_connect_backoff_expired(&s_connect);
+        }
+    } else if (event_base == WIFI_CONNECT_EVENT && event_id == WIFI_CONNECT_EVENT_RECONFIGURE) {
+        struct reconfigure_params *params = (struct reconfigure_params *) event_data;
+        ESP_LOGI(TAG, "Switching to the new config");
+        s_has_rollback = params->has_previous;
+        s_rollback = params->previous;
+        s_status = "Connecting with the new config...";
+        switch_config();
+    } else if (event_base == WIFI_CONNECT_EVENT && event_id == WIFI_CONNECT_EVENT_ROLLBACK) {
+        if (!s_has_rollback) {
+            return;
         }
+        ESP_LOGW(TAG, "New config didn't get an IP in %lld s, going back to the old one", RECONFIGURE_DEADLINE_US / 1000000);
+        s_has_rollback = false;
+        wifi_save_config(&s_rollback);
+        s_status = "The new config didn't work, so it's back on the old one";
+        switch_config();
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
-        s_retry_num = 0;
-        evgrp_set_bits(WIFI_CONNECTED_BIT);
+        int64_t time_to_ip = wifi_connect_got_ip(&s_connect);
+        ESP_LOGI(TAG, "Got IP:" IPSTR " in %lld ms on the %s path", IP2STR(&event->ip_info.ip), time_to_ip / 1000,
+            s_connect.path == wifi_path_fast ? "fast" : "full");
+
+        if (s_has_rollback) {
+            esp_timer_stop(s_rollback_timer);
+            s_has_rollback = false;
+            s_status = "Connected with the new config";
+            ESP_LOGI(TAG, "Switched to the new config in %lld ms", (esp_timer_get_time() - s_reconfigured_at) / 1000);
+        }
+        evgrp_set_bits(WIFI_CONNECTED_BIT | WIFI_RECOVERED_BIT);
     }
 }
 
+// skips DHCP if there's a static IP; DHCP itself reuses the last lease (CONFIG_LWIP_DHCP_RESTORE_LAST_IP)
+static void apply_ip_config(void) {
+    esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns;
+
+    if (netif == NULL) {
+        return;
+    }
+
+    esp_err_t err;
+    if (wifi_load_static_ip(&ip_info, &dns) != 0) {
+        // might have had a static IP before a reconfigure
+        err = esp_netif_dhcpc_start(netif);
+        if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED) {
+            ESP_LOGE(TAG, "Couldn't start DHCP (%s)", esp_err_to_name(err));
+        }
+        return;
+    }
+
+    err = esp_netif_dhcpc_stop(netif);
+    if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED) {
+        ESP_LOGE(TAG, "Couldn't stop DHCP (%s), using it after all", esp_err_to_name(err));
+        return;
+    }
+
+    ESP_ERROR_CHECK(esp_netif_set_ip_info(netif, &ip_info));
+    ESP_ERROR_CHECK(esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns));
+    ESP_LOGI(TAG, "Using static IP " IPSTR, IP2STR(&ip_info.ip));
+}
+
 /**
  * @brief Inits and starts connecting to WiFi.
  * 
  * Make sure to create an event group and assign it to `wifi_event_group` if
- * you want to know the status of the connection.
+ * you want to know the status of the connection. Call it once; it keeps
+ * reconnecting for good.
  */
 void connect_wifi() {
     ESP_LOGI(TAG, "Init WiFi...");
 
+    struct wifi_hint hint;
+    wifi_connect_init(&s_connect, &sta_ops, wifi_load_hint(&hint) == 0 ? &hint : NULL);
+    apply_ip_config();
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = backoff_expired,
+        .name = "wifi_backoff",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_backoff_timer));
+
+    const esp_timer_create_args_t rollback_args = {
+        .callback = rollback_expired,
+        .name = "wifi_rollback",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&rollback_args, &s_rollback_timer));
+
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                         ESP_EVENT_ANY_ID,
                                                         &event_handler,
@@ -82,7 +290,31 @@ void connect_wifi() {
                                                         &event_handler,
                                                         NULL,
                                                         &s_wifi_instance_got_ip));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_CONNECT_EVENT,
+                                                        ESP_EVENT_ANY_ID,
+                                                        &event_handler,
+                                                        NULL,
+                                                        &s_connect_instance));
 
     ESP_LOGI(TAG, "WiFi init finished, starting connect...");
     ESP_ERROR_CHECK(esp_wifi_start());
-}
\ No newline at end of file
+}
+
+int wifi_sta_reconfigure(const struct wifi_sta_settings *previous) {
+    if (s_connect.ops == NULL) { // connect_wifi() never ran
+        return 1;
+    }
+
+    struct reconfigure_params params = { .has_previous = previous != NULL };
+    if (previous != NULL) {
+        params.previous = *previous;
+    }
+
+    // the state machine only runs on the event loop
+    esp_event_post(WIFI_CONNECT_EVENT, WIFI_CONNECT_EVENT_RECONFIGURE, &params, sizeof(params), portMAX_DELAY);
+    return 0;
+}
+
+const char *wifi_sta_status(void) {
+    return s_status;
+}
@@ -1 +1,19 @@
-void connect_wifi();
\ No newline at end of file
+#ifndef WIFI_STA_H
+#define WIFI_STA_H
+
+#include "wifi_config.h"
+
+void connect_wifi();
+
+/**
+ * reconnects with the config now in NVS, without a restart
+ *
+ * if that doesn't get an IP in time, previous is saved back and used instead; previous may be
+ * NULL if there's nothing to go back to. returns 1 if the STA isn't running
+ */
+int wifi_sta_reconfigure(const struct wifi_sta_settings *previous);
+
+// what's become of the last reconfigure, for the config page
+const char *wifi_sta_status(void);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wifi_connect.h"
+
+// mirrors wifi_connect.c
+#define FULL_PATH_TRIES 3
+#define BACKOFF_BASE_US 1000000LL
+#define BACKOFF_MAX_US 60000000LL
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, __func__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * simulated driver: records what the state machine asked for, and lets the test play the
+ * events back. the clock only moves when the test says so.
+ */
+static struct {
+    int associates;
+    bool last_had_hint;
+    struct wifi_hint last_hint;
+
+    int saved_hints;
+    struct wifi_hint saved;
+
+    int schedules;
+    int64_t last_delay_us;
+
+    int64_t now_us;
+    uint32_t next_random;
+} sim;
+
+static void sim_associate(const struct wifi_hint *hint) {
+    sim.associates++;
+    sim.last_had_hint = hint != NULL;
+    if (hint != NULL) {
+        sim.last_hint = *hint;
+    }
+}
+
+static void sim_save_hint(const struct wifi_hint *hint) {
+    sim.saved_hints++;
+    sim.saved = *hint;
+}
+
+static void sim_schedule(int64_t delay_us) {
+    sim.schedules++;
+    sim.last_delay_us = delay_us;
+}
+
+static int64_t sim_now_us(void) {
+    return sim.now_us;
+}
+
+static uint32_t sim_random(void) {
+    return sim.next_random;
+}
+
+static const struct wifi_connect_ops sim_ops = {
+    .associate = sim_associate,
+    .save_hint = sim_save_hint,
+    .schedule = sim_schedule,
+    .now_us = sim_now_us,
+    .random = sim_random,
+};
+
+static const struct wifi_hint home = { .bssid = {1, 2, 3, 4, 5, 6}, .channel = 6 };
+static const struct wifi_hint other = { .bssid = {6, 5, 4, 3, 2, 1}, .channel = 11 };
+
+static void reset(void) {
+    memset(&sim, 0, sizeof(sim));
+}
+
+// runs the full path until it backs off, returning the delay it asked for
+static int64_t fail_until_backoff(struct wifi_connect *conn) {
+    int schedules = sim.schedules;
+    for (int i = 0; i < FULL_PATH_TRIES && sim.schedules == schedules; i++) {
+        CHECK(conn->path == wifi_path_full);
+        wifi_connect_disconnected(conn);
+    }
+    CHECK(conn->state == wifi_state_backoff);
+    CHECK(sim.schedules == schedules + 1);
+    return sim.last_delay_us;
+}
+
+static void test_fast_path(void) {
+    reset();
+    struct wifi_connect conn;
+    wifi_connect_init(&conn, &sim_ops, &home);
+    CHECK(conn.state == wifi_state_idle);
+
+    sim.now_us = 1000;
+    wifi_connect_start(&conn);
+    CHECK(conn.state == wifi_state_associating);
+    CHECK(conn.path == wifi_path_fast);
+    CHECK(sim.associates == 1);
+    CHECK(sim.last_had_hint);
+    CHECK(memcmp(&sim.last_hint, &home, sizeof(home)) == 0);
+
+    wifi_connect_associated(&conn, &home);
+    CHECK(conn.state == wifi_state_waiting_ip);
+
+    sim.now_us = 251000;
+    CHECK(wifi_connect_got_ip(&conn) == 250000);
+    CHECK(conn.state == wifi_state_connected);
+    // same AP as the hint, so there's nothing to save
+    CHECK(sim.saved_hints == 0);
+}
+
+static void test_no_hint_scans(void) {
+    reset();
+    struct wifi_connect conn;
+    wifi_connect_init(&conn, &sim_ops, NULL);
+    wifi_connect_start(&conn);
+    CHECK(conn.path == wifi_path_full);
+    CHECK(sim.associates == 1);
+    CHECK(!sim.last_had_hint);
+
+    wifi_connect_associated(&conn, &other);
+    wifi_connect_got_ip(&conn);
+    CHECK(sim.saved_hints == 1);
+    CHECK(memcmp(&sim.saved, &other, sizeof(other)) == 0);
+    CHECK(conn.has_hint);
+}
+
+static void test_fast_path_falls_back_to_scan(void) {
+    reset();
+    struct wifi_connect conn;
+    wifi_connect_init(&conn, &sim_ops, &home);
+    wifi_connect_start(&conn);
+
+    CHECK(wifi_connect_disconnected(&conn) == wifi_state_associating);
+    CHECK(conn.path == wifi_path_full);
+    CHECK(conn.retries == 0);
+    CHECK(sim.associates == 2);
+    CHECK(!sim.last_had_hint);
+
+    // a new AP answers the scan; it becomes the hint
+    wifi_connect_associated(&conn, &other);
+    wifi_connect_got_ip(&conn);
+    CHECK(sim.saved_hints == 1);
+    CHECK(memcmp(&conn.hint, &other, sizeof(other)) == 0);
+}
+
+static void test_scan_retries_then_backoff(void) {
+    reset();
+    struct wifi_connect conn;
+    wifi_connect_init(&conn, &sim_ops, NULL);
+    wifi_connect_start(&conn);
+
+    // the first FULL_PATH_TRIES - 1 failures retry right away
+    for (int i = 1; i < FULL_PATH_TRIES; i++) {
+        CHECK(wifi_connect_disconnected(&conn) == wifi_state_associating);
+        CHECK(conn.retries == i);
+        CHECK(sim.associates == 1 + i);
+        CHECK(sim.schedules == 0);
+    }
+
+    CHECK(wifi_connect_disconnected(&conn) == wifi_state_backoff);
+    CHECK(sim.schedules == 1);
+    CHECK(sim.associates == FULL_PATH_TRIES);
+    CHECK(conn.backoffs == 1);
+
+    // a disconnect while waiting changes nothing
+    CHECK(wifi_connect_disconnected(&conn) == wifi_state_backoff);
+    CHECK(sim.associates == FULL_PATH_TRIES);
+
+    wifi_connect_backoff_expired(&conn);
+    CHECK(conn.state == wifi_state_associating);
+    CHECK(conn.path == wifi_path_full);
+    CHECK(conn.retries == 0);
+    CHECK(sim.associates == FULL_PATH_TRIES + 1);
+
+    // a late expiry, once we're trying again, is ignored
+    wifi_connect_backoff_expired(&conn);
+    CHECK(sim.associates == FULL_PATH_TRIES + 1);
+}
+
+static void test_backoff_scans_even_with_hint(void) {
+    reset();
+    struct wifi_connect conn;
+    wifi_connect_init(&conn, &sim_ops, &home);
+    wifi_connect_start(&conn);
+    wifi_connect_disconnected(&conn);
+    fail_until_backoff(&conn);
+
+    wifi_connect_backoff_expired(&conn);
+    CHECK(conn.path == wifi_path_full);
+    CHECK(!sim.last_had_hint);
+}
+
+static void test_backoff_delay_bounds(void) {
+    static const uint32_t randoms[] = {0, 1, 12345, 0x7fffffff, 0xffffffff};
+
+    for (size_t r = 0; r < sizeof(randoms) / sizeof(randoms[0]); r++) {
+        reset();
+        sim.next_random = randoms[r];
+        struct wifi_connect conn;
+        wifi_connect_init(&conn, &sim_ops, NULL);
+        wifi_connect_start(&conn);
+
+        for (int k = 0; k < 10; k++) {
+            int64_t delay = fail_until_backoff(&conn);
+            int64_t cap = BACKOFF_BASE_US << k;
+            if (cap > BACKOFF_MAX_US) {
+                cap = BACKOFF_MAX_US;
+            }
+            // jittered into the upper half, never past the cap
+            CHECK(delay >= cap / 2);
+            CHECK(delay <= cap);
+            wifi_connect_backoff_expired(&conn);
+        }
+    }
+
+    // the extremes of the jitter are reachable
+    reset();
+    struct wifi_connect conn;
+    wifi_connect_init(&conn, &sim_ops, NULL);
+    wifi_connect_start(&conn);
+    sim.next_random = 0;
+    CHECK(fail_until_backoff(&conn) == BACKOFF_BASE_US / 2);
+    wifi_connect_backoff_expired(&conn);
+    sim.next_random = BACKOFF_BASE_US; // 2 s cap, so this is its top
+    CHECK(fail_until_backoff(&conn) == 2 * BACKOFF_BASE_US);
+}
+
+static void test_got_ip_resets_backoff(void) {
+    reset();
+    struct wifi_connect conn;
+    wifi_connect_init(&conn, &sim_ops, NULL);
+    wifi_connect_start(&conn);
+    for (int k = 0; k < 4; k++) {
+        fail_until_backoff(&conn);
+        wifi_connect_backoff_expired(&conn);
+    }
+    CHECK(conn.backoffs == 4);
+
+    wifi_connect_associated(&conn, &home);
+    wifi_connect_got_ip(&conn);
+    CHECK(conn.backoffs == 0);
+
+    // losing the AP goes straight back to it, on the fast path
+    int associates = sim.associates;
+    CHECK(wifi_connect_disconnected(&conn) == wifi_state_associating);
+    CHECK(conn.path == wifi_path_fast);
+    CHECK(sim.associates == associates + 1);
+    CHECK(sim.last_had_hint);
+    CHECK(memcmp(&sim.last_hint, &home, sizeof(home)) == 0);
+
+    // and the next backoff starts from the bottom again
+    wifi_connect_disconnected(&conn);
+    int64_t delay = fail_until_backoff(&conn);
+    CHECK(delay >= BACKOFF_BASE_US / 2 && delay <= BACKOFF_BASE_US);
+}
+
+static void test_idle_ignores_events(void) {
+    reset();
+    struct wifi_connect conn;
+    wifi_connect_init(&conn, &sim_ops, &home);
+    CHECK(wifi_connect_disconnected(&conn) == wifi_state_idle);
+    wifi_connect_backoff_expired(&conn);
+    CHECK(conn.state == wifi_state_idle);
+    CHECK(sim.associates == 0);
+    CHECK(sim.schedules == 0);
+}
+
+int main(void) {
+    test_fast_path();
+    test_no_hint_scans();
+    test_fast_path_falls_back_to_scan();
+    test_scan_retries_then_backoff();
+    test_backoff_scans_even_with_hint();
+    test_backoff_delay_bounds();
+    test_got_ip_resets_backoff();
+    test_idle_ignores_events();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("all wifi_connect tests passed\n");
+    return EXIT_SUCCESS;
+}